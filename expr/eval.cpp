@@ -0,0 +1,914 @@
+#include<algorithm>
+#include<cstdio>
+#include<cstring>
+
+#include "eval.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include<sys/mman.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEXER_SIMD_X86
+#include<immintrin.h>
+#endif
+
+namespace expr {
+
+void FlatAst::clear()
+{
+	kind.clear();
+	op.clear();
+	value.clear();
+	first.clear();
+}
+
+void FlatAst::push_number(const Value& v)
+{
+	first.push_back((uint32_t)kind.size());
+	kind.push_back(FlatKind::Number);
+	op.push_back(TokenType::INTLTR);
+	value.push_back(v);
+}
+
+void FlatAst::push_variable(uint32_t name)
+{
+	first.push_back((uint32_t)kind.size());
+	kind.push_back(FlatKind::Variable);
+	op.push_back(TokenType::IDENT);
+	value.push_back(int_value((int)name));
+}
+
+void FlatAst::push_unary(TokenType o)
+{
+	first.push_back(first.back());
+	kind.push_back(FlatKind::Unary);
+	op.push_back(o);
+	value.push_back(Value());
+}
+
+void FlatAst::push_binary(TokenType o)
+{
+	first.push_back(first[first[first.size() - 1] - 1]);
+	kind.push_back(FlatKind::Binary);
+	op.push_back(o);
+	value.push_back(Value());
+}
+
+Value FlatAst::evaluate(std::vector<Value>& stack, bool& div_by_zero) const
+{
+	stack.clear();
+	for (size_t i = 0; i < kind.size(); i++) {
+		switch (kind[i]) {
+		case FlatKind::Number:
+			stack.push_back(value[i]);
+			break;
+		case FlatKind::Variable:
+			assert(0 && "a variable has no value here");
+			stack.push_back(Value());
+			break;
+		case FlatKind::Unary:
+			stack.back() = apply_unary(op[i], stack.back());
+			break;
+		case FlatKind::Binary: {
+			Value rhs = stack.back();
+			stack.pop_back();
+			stack.back() = apply_binary(op[i], stack.back(), rhs, div_by_zero);
+			break;
+		}
+		}
+	}
+	return stack.empty() ? Value() : stack.back();
+}
+
+void flatten(const AstNode* root, FlatAst& out)
+{
+	struct Builder {
+		FlatAst& out;
+		void number(const Value& v) { out.push_number(v); }
+		void variable(uint32_t name) { out.push_variable(name); }
+		void unary(TokenType o) { out.push_unary(o); }
+		void binary(TokenType o) { out.push_binary(o); }
+	};
+
+	out.clear();
+	Builder b{ out };
+	walk_postorder(root, b, out.walk);
+}
+
+static bool is_digit(char c, int base)
+{
+	switch (base) {
+	case 2: return c == '0' || c == '1';
+	case 8: return c >= '0' && c <= '7';
+	case 10: return c >= '0' && c <= '9';
+	default: return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+	}
+}
+
+// All of s is one int literal the way decode_literal reads them: decimal, or '0x' hex, '0b' binary or '0' octal
+// digits, with at least one digit after '0x' and '0b'
+static bool is_int_literal(std::string_view s)
+{
+	if (s == "0") {
+		return true;
+	}
+	size_t i = 0;
+	int base = 10;
+	if (s.size() >= 2 && s[0] == '0' && s[1] == 'x') {
+		base = 16;
+		i = 2;
+	}
+	else if (s.size() >= 2 && s[0] == '0' && s[1] == 'b') {
+		base = 2;
+		i = 2;
+	}
+	else if (!s.empty() && s[0] == '0') {
+		base = 8;
+		i = 1;
+	}
+	if (i == s.size()) {
+		return false;
+	}
+	for (; i < s.size(); i++) {
+		if (!is_digit(s[i], base)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static std::string_view trim_spaces(std::string_view s)
+{
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t' || s.front() == '\r')) {
+		s.remove_prefix(1);
+	}
+	while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) {
+		s.remove_suffix(1);
+	}
+	return s;
+}
+
+bool ColumnTable::load(const char* path, std::string& error)
+{
+	InputReader in(path);
+	if (!in.ok()) {
+		error = std::string("cannot open ") + path;
+		return false;
+	}
+	std::string text;
+	const char* data;
+	size_t size;
+	while (in.next_chunk(data, size)) {
+		text.append(data, size);
+	}
+
+	size_t line_no = 0;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t nl = text.find('\n', pos);
+		if (nl == std::string::npos) {
+			nl = text.size();
+		}
+		std::string_view line(text.data() + pos, nl - pos);
+		pos = nl + 1;
+		line_no++;
+		if (trim_spaces(line).empty()) {
+			continue;
+		}
+
+		const bool header = columns.empty();
+		size_t cell = 0;
+		for (size_t begin = 0; begin <= line.size(); cell++) {
+			size_t comma = line.find(',', begin);
+			if (comma == std::string_view::npos) {
+				comma = line.size();
+			}
+			std::string_view field = trim_spaces(line.substr(begin, comma - begin));
+			begin = comma + 1;
+
+			if (header) {
+				if (field.empty() || !is_ascii_letter(field[0]) ||
+					std::find_if(field.begin(), field.end(), [](char c) { return !is_ascii_alnum(c); }) != field.end()) {
+					error = "line " + std::to_string(line_no) + ": '" + std::string(field) + "' is not an identifier";
+					return false;
+				}
+				if (find(field) >= 0) {
+					error = "line " + std::to_string(line_no) + ": '" + std::string(field) + "' is there twice";
+					return false;
+				}
+				names.emplace_back(field);
+				continue;
+			}
+			if (cell >= columns.size()) {
+				error = "line " + std::to_string(line_no) + ": more than " + std::to_string(columns.size()) + " values";
+				return false;
+			}
+			// An int literal, with a '-' in front if it is negative
+			bool negative = !field.empty() && field[0] == '-';
+			const std::string_view literal = trim_spaces(field.substr(negative ? 1 : 0));
+			const std::string where = "line " + std::to_string(line_no) + ", column " + std::to_string(cell + 1) + " (" + names[cell] + ")";
+			if (!is_int_literal(literal)) {
+				error = where + ": '" + std::string(field) + "' is not an int literal";
+				return false;
+			}
+			uint64_t decoded;
+			if (!decode_literal(literal, decoded) || decoded > UINT32_MAX) {
+				error = where + ": '" + std::string(field) + "' is out of range";
+				return false;
+			}
+			int value = (int)(uint32_t)decoded;
+			columns[cell].push_back(negative ? apply_unary(TokenType::MINU, value) : value);
+		}
+
+		if (header) {
+			columns.resize(names.size());
+		}
+		else if (cell != columns.size()) {
+			error = "line " + std::to_string(line_no) + ": " + std::to_string(cell) + " values for " + std::to_string(columns.size()) + " columns";
+			return false;
+		}
+		else {
+			rows++;
+		}
+	}
+
+	if (names.empty()) {
+		error = std::string(path) + " has no header line";
+		return false;
+	}
+	return true;
+}
+
+int ColumnTable::find(std::string_view name) const
+{
+	for (size_t i = 0; i < names.size(); i++) {
+		if (names[i] == name) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// Column kernels: one operator applied to n rows at once, with the arithmetic of apply_binary.
+// A row that divides by zero gets 0 and its byte in div_by_zero is set.
+typedef void (*BinaryKernel)(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t* div_by_zero);
+typedef void (*UnaryKernel)(const int* src, int* dst, size_t n);
+
+struct ColumnKernels
+{
+	BinaryKernel add;
+	BinaryKernel sub;
+	BinaryKernel mul;
+	BinaryKernel div;
+	UnaryKernel neg;
+	const char* name;
+};
+
+static void add_scalar(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t*)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = (int)((unsigned)lhs[i] + (unsigned)rhs[i]);
+	}
+}
+
+static void sub_scalar(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t*)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = (int)((unsigned)lhs[i] - (unsigned)rhs[i]);
+	}
+}
+
+static void mul_scalar(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t*)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = (int)((unsigned)lhs[i] * (unsigned)rhs[i]);
+	}
+}
+
+static void div_scalar(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t* div_by_zero)
+{
+	for (size_t i = 0; i < n; i++) {
+		bool zero = false;
+		dst[i] = apply_binary(TokenType::DIV, lhs[i], rhs[i], zero);
+		div_by_zero[i] |= (uint8_t)zero;
+	}
+}
+
+static void neg_scalar(const int* src, int* dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = (int)(0u - (unsigned)src[i]);
+	}
+}
+
+#ifdef LEXER_SIMD_X86
+__attribute__((target("avx2")))
+static void add_avx2(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t* div_by_zero)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(lhs + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(rhs + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi32(a, b));
+	}
+	add_scalar(lhs + i, rhs + i, dst + i, n - i, div_by_zero + i);
+}
+
+__attribute__((target("avx2")))
+static void sub_avx2(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t* div_by_zero)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(lhs + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(rhs + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_sub_epi32(a, b));
+	}
+	sub_scalar(lhs + i, rhs + i, dst + i, n - i, div_by_zero + i);
+}
+
+__attribute__((target("avx2")))
+static void mul_avx2(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t* div_by_zero)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(lhs + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(rhs + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_mullo_epi32(a, b));
+	}
+	mul_scalar(lhs + i, rhs + i, dst + i, n - i, div_by_zero + i);
+}
+
+// Through double: an int32 quotient is exact in a double, truncation gives the int quotient,
+// and INT_MIN / -1 converts to 0x80000000, which is INT_MIN like in apply_binary
+__attribute__((target("avx2")))
+static void div_avx2(const int* lhs, const int* rhs, int* dst, size_t n, uint8_t* div_by_zero)
+{
+	size_t i = 0;
+	const __m256i zero = _mm256_setzero_si256();
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(lhs + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(rhs + i));
+		__m256i is_zero = _mm256_cmpeq_epi32(b, zero);
+		unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(is_zero));
+		if (mask != 0) {
+			b = _mm256_blendv_epi8(b, _mm256_set1_epi32(1), is_zero);
+			for (unsigned k = 0; k < 8; k++) {
+				div_by_zero[i + k] |= (uint8_t)((mask >> k) & 1);
+			}
+		}
+		__m256d q_lo = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(a)), _mm256_cvtepi32_pd(_mm256_castsi256_si128(b)));
+		__m256d q_hi = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1)), _mm256_cvtepi32_pd(_mm256_extracti128_si256(b, 1)));
+		__m256i q = _mm256_set_m128i(_mm256_cvttpd_epi32(q_hi), _mm256_cvttpd_epi32(q_lo));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_andnot_si256(is_zero, q));
+	}
+	div_scalar(lhs + i, rhs + i, dst + i, n - i, div_by_zero + i);
+}
+
+__attribute__((target("avx2")))
+static void neg_avx2(const int* src, int* dst, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_sub_epi32(_mm256_setzero_si256(), v));
+	}
+	neg_scalar(src + i, dst + i, n - i);
+}
+#endif
+
+// Pick the column kernels once at startup, COLUMN_SIMD=scalar forces the scalar ones
+static ColumnKernels select_column_kernels()
+{
+	ColumnKernels scalar = { add_scalar, sub_scalar, mul_scalar, div_scalar, neg_scalar, "scalar" };
+	const char* env = std::getenv("COLUMN_SIMD");
+	if (env != nullptr && std::string(env) == "scalar") {
+		return scalar;
+	}
+#ifdef LEXER_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return { add_avx2, sub_avx2, mul_avx2, div_avx2, neg_avx2, "avx2" };
+	}
+#endif
+	return scalar;
+}
+
+static const ColumnKernels column_kernels = select_column_kernels();
+
+bool ColumnEvaluator::compile(const FlatAst& flat, const ColumnTable& table, const NameTable& names)
+{
+	steps.clear();
+	max_stack = 0;
+	is_float = false;
+	size_t depth = 0;
+	for (size_t i = 0; i < flat.size(); i++) {
+		Step step{ flat.kind[i], flat.op[i], flat.value[i].i, flat.value[i] };
+		switch (step.kind) {
+		case FlatKind::Number:
+			is_float |= step.literal.is_float;
+			depth++;
+			break;
+		case FlatKind::Variable:
+			step.arg = table.find(names.name((uint32_t)flat.value[i].i));
+			if (step.arg < 0) {
+				return false;
+			}
+			depth++;
+			break;
+		case FlatKind::Unary:
+			if (step.op == TokenType::PLUS) {
+				continue;
+			}
+			break;
+		case FlatKind::Binary:
+			depth--;
+			break;
+		}
+		max_stack = std::max(max_stack, depth);
+		steps.push_back(step);
+	}
+
+	block_rows = std::max((size_t)8, std::min(MAX_BLOCK_ROWS, SCRATCH_INTS / std::max((size_t)1, max_stack)));
+	if (scratch.size() < max_stack * block_rows) {
+		scratch.resize(max_stack * block_rows);
+	}
+	operands.resize(max_stack);
+	return true;
+}
+
+void ColumnEvaluator::run(const ColumnTable& table, std::vector<int>& values, std::vector<uint8_t>& div_by_zero)
+{
+	values.resize(table.rows);
+	div_by_zero.assign(table.rows, 0);
+
+	for (size_t row = 0; row < table.rows; row += block_rows) {
+		const size_t n = std::min(block_rows, table.rows - row);
+		uint8_t* zero = div_by_zero.data() + row;
+		size_t sp = 0;
+		for (const Step& step : steps) {
+			switch (step.kind) {
+			case FlatKind::Number: {
+				int* dst = scratch.data() + sp * block_rows;
+				std::fill_n(dst, n, step.arg);
+				operands[sp++] = dst;
+				break;
+			}
+			case FlatKind::Variable:
+				operands[sp++] = table.columns[step.arg].data() + row;
+				break;
+			case FlatKind::Unary: {
+				int* dst = scratch.data() + (sp - 1) * block_rows;
+				column_kernels.neg(operands[sp - 1], dst, n);
+				operands[sp - 1] = dst;
+				break;
+			}
+			case FlatKind::Binary: {
+				int* dst = scratch.data() + (sp - 2) * block_rows;
+				BinaryKernel kernel = step.op == TokenType::PLUS ? column_kernels.add :
+					step.op == TokenType::MINU ? column_kernels.sub :
+					step.op == TokenType::MULT ? column_kernels.mul : column_kernels.div;
+				kernel(operands[sp - 2], operands[sp - 1], dst, n, zero);
+				operands[sp - 2] = dst;
+				sp--;
+				break;
+			}
+			}
+		}
+		std::copy_n(operands[0], n, values.data() + row);
+	}
+}
+
+void ColumnEvaluator::run_float(const ColumnTable& table, std::vector<double>& values, std::vector<uint8_t>& div_by_zero)
+{
+	values.resize(table.rows);
+	div_by_zero.assign(table.rows, 0);
+	row_stack.resize(max_stack);
+
+	for (size_t row = 0; row < table.rows; row++) {
+		Value* sp = row_stack.data();
+		bool zero = false;
+		for (const Step& step : steps) {
+			switch (step.kind) {
+			case FlatKind::Number:
+				*sp++ = step.literal;
+				break;
+			case FlatKind::Variable:
+				*sp++ = int_value(table.columns[step.arg][row]);
+				break;
+			case FlatKind::Unary:
+				sp[-1] = apply_unary(TokenType::MINU, sp[-1]);
+				break;
+			case FlatKind::Binary:
+				sp--;
+				sp[-1] = apply_binary(step.op, sp[-1], sp[0], zero);
+				break;
+			}
+		}
+		values[row] = row_stack[0].f;
+		div_by_zero[row] = zero;
+	}
+}
+
+void Program::clear()
+{
+	code.clear();
+	max_stack = 0;
+	is_float = false;
+	depth = 0;
+	types.clear();
+}
+
+void Program::emit(OpCode op)
+{
+	code.push_back((uint8_t)op);
+	if (op != OpCode::Neg && op != OpCode::NegFloat && op != OpCode::ToFloat && op != OpCode::ToFloatUnder && op != OpCode::Halt) {
+		depth--;
+	}
+}
+
+void Program::emit_push(const Value& v)
+{
+	code.push_back((uint8_t)(v.is_float ? OpCode::PushFloat : OpCode::Push));
+	size_t at = code.size();
+	if (v.is_float) {
+		code.resize(at + sizeof(double));
+		std::memcpy(&code[at], &v.f, sizeof(double));
+	}
+	else {
+		code.resize(at + sizeof(int));
+		std::memcpy(&code[at], &v.i, sizeof(int));
+	}
+	depth++;
+	max_stack = std::max(max_stack, depth);
+}
+
+// Threaded dispatch through a table of label addresses where the compiler has it, a switch otherwise
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+Value Program::run(Stack& stack, bool& div_by_zero) const
+{
+	if (stack.size() < max_stack) {
+		stack.resize(max_stack);
+	}
+	Slot* sp = stack.data();  // the first free slot
+	const uint8_t* pc = code.data();
+
+#ifdef VM_COMPUTED_GOTO
+	static const void* const dispatch[] = { &&do_Push, &&do_Add, &&do_Sub, &&do_Mul, &&do_Div, &&do_Neg,
+		&&do_PushFloat, &&do_AddFloat, &&do_SubFloat, &&do_MulFloat, &&do_DivFloat, &&do_NegFloat,
+		&&do_ToFloat, &&do_ToFloatUnder, &&do_Halt };
+#define VM_CASE(name) do_##name:
+#define VM_NEXT() goto *dispatch[*pc++]
+	VM_NEXT();
+#else
+#define VM_CASE(name) case OpCode::name:
+#define VM_NEXT() break
+	for (;;) {
+	switch ((OpCode)*pc++) {
+#endif
+	VM_CASE(Push) {
+		std::memcpy(&sp->i, pc, sizeof(int));
+		pc += sizeof(int);
+		sp++;
+		VM_NEXT();
+	}
+	VM_CASE(Add) {
+		sp--;
+		sp[-1].i = apply_binary(TokenType::PLUS, sp[-1].i, sp[0].i, div_by_zero);
+		VM_NEXT();
+	}
+	VM_CASE(Sub) {
+		sp--;
+		sp[-1].i = apply_binary(TokenType::MINU, sp[-1].i, sp[0].i, div_by_zero);
+		VM_NEXT();
+	}
+	VM_CASE(Mul) {
+		sp--;
+		sp[-1].i = apply_binary(TokenType::MULT, sp[-1].i, sp[0].i, div_by_zero);
+		VM_NEXT();
+	}
+	VM_CASE(Div) {
+		sp--;
+		sp[-1].i = apply_binary(TokenType::DIV, sp[-1].i, sp[0].i, div_by_zero);
+		VM_NEXT();
+	}
+	VM_CASE(Neg) {
+		sp[-1].i = apply_unary(TokenType::MINU, sp[-1].i);
+		VM_NEXT();
+	}
+	VM_CASE(PushFloat) {
+		std::memcpy(&sp->f, pc, sizeof(double));
+		pc += sizeof(double);
+		sp++;
+		VM_NEXT();
+	}
+	VM_CASE(AddFloat) {
+		sp--;
+		sp[-1].f = apply_float_binary(TokenType::PLUS, sp[-1].f, sp[0].f);
+		VM_NEXT();
+	}
+	VM_CASE(SubFloat) {
+		sp--;
+		sp[-1].f = apply_float_binary(TokenType::MINU, sp[-1].f, sp[0].f);
+		VM_NEXT();
+	}
+	VM_CASE(MulFloat) {
+		sp--;
+		sp[-1].f = apply_float_binary(TokenType::MULT, sp[-1].f, sp[0].f);
+		VM_NEXT();
+	}
+	VM_CASE(DivFloat) {
+		sp--;
+		sp[-1].f = apply_float_binary(TokenType::DIV, sp[-1].f, sp[0].f);
+		VM_NEXT();
+	}
+	VM_CASE(NegFloat) {
+		sp[-1].f = -sp[-1].f;
+		VM_NEXT();
+	}
+	VM_CASE(ToFloat) {
+		sp[-1].f = (double)sp[-1].i;
+		VM_NEXT();
+	}
+	VM_CASE(ToFloatUnder) {
+		sp[-2].f = (double)sp[-2].i;
+		VM_NEXT();
+	}
+	VM_CASE(Halt) {
+		return is_float ? float_value(sp[-1].f) : int_value(sp[-1].i);
+	}
+#ifndef VM_COMPUTED_GOTO
+	}
+	}
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+void compile(const AstNode* root, Program& out)
+{
+	struct Builder {
+		Program& out;
+		void number(const Value& v) {
+			out.emit_push(v);
+			out.types.push_back(v.is_float);
+		}
+		void variable(uint32_t) { assert(0 && "a Program has no variables"); }
+		void unary(TokenType o) {
+			if (o == TokenType::MINU) {
+				out.emit(out.types.back() ? OpCode::NegFloat : OpCode::Neg);
+			}
+		}
+		void binary(TokenType o) {
+			bool rhs_float = out.types.back();
+			out.types.pop_back();
+			bool lhs_float = out.types.back();
+			if (!lhs_float && !rhs_float) {
+				switch (o) {
+				case TokenType::PLUS: out.emit(OpCode::Add); break;
+				case TokenType::MINU: out.emit(OpCode::Sub); break;
+				case TokenType::MULT: out.emit(OpCode::Mul); break;
+				case TokenType::DIV: out.emit(OpCode::Div); break;
+				default: assert(0 && "invalid binary operator");
+				}
+				return;
+			}
+
+			// The usual conversions: the int operand becomes a double
+			if (!lhs_float) {
+				out.emit(OpCode::ToFloatUnder);
+			}
+			if (!rhs_float) {
+				out.emit(OpCode::ToFloat);
+			}
+			out.types.back() = true;
+			switch (o) {
+			case TokenType::PLUS: out.emit(OpCode::AddFloat); break;
+			case TokenType::MINU: out.emit(OpCode::SubFloat); break;
+			case TokenType::MULT: out.emit(OpCode::MulFloat); break;
+			case TokenType::DIV: out.emit(OpCode::DivFloat); break;
+			default: assert(0 && "invalid binary operator");
+			}
+		}
+	};
+
+	out.clear();
+	Builder b{ out };
+	walk_postorder(root, b, out.walk);
+	out.is_float = out.types.back();
+	out.emit(OpCode::Halt);
+}
+
+static inline size_t dag_hash(FlatKind kind, TokenType op, uint32_t lhs, uint32_t rhs)
+{
+	uint64_t h = ((uint64_t)lhs << 32 | rhs) * 0x9E3779B97F4A7C15ull;
+	h ^= ((uint64_t)kind << 8 | (uint64_t)op) * 0xC2B2AE3D27D4EB4Full;
+	return (size_t)(h ^ (h >> 29));
+}
+
+void ExprDag::grow()
+{
+	slots.assign(slots.empty() ? 1024 : slots.size() * 2, EMPTY);
+	const size_t mask = slots.size() - 1;
+	for (uint32_t id = 0; id < nodes.size(); id++) {
+		const Node& n = nodes[id];
+		size_t i = dag_hash(n.kind, n.op, n.lhs, n.rhs) & mask;
+		while (slots[i] != EMPTY) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = id;
+	}
+}
+
+uint32_t ExprDag::intern(FlatKind kind, TokenType op, uint32_t lhs, uint32_t rhs, const Value& value)
+{
+	visited++;
+	if (kind == FlatKind::Number) {
+		uint64_t bits = (uint32_t)value.i;
+		if (value.is_float) {
+			std::memcpy(&bits, &value.f, sizeof(bits));
+		}
+		op = value.is_float ? TokenType::FLOATLTR : TokenType::INTLTR;
+		lhs = (uint32_t)(bits >> 32);
+		rhs = (uint32_t)bits;
+	}
+	if (2 * (nodes.size() + 1) > slots.size()) {
+		grow();  // keeps the table at most half full
+	}
+
+	const size_t mask = slots.size() - 1;
+	size_t i = dag_hash(kind, op, lhs, rhs) & mask;
+	for (; slots[i] != EMPTY; i = (i + 1) & mask) {
+		const Node& n = nodes[slots[i]];
+		if (n.kind == kind && n.op == op && n.lhs == lhs && n.rhs == rhs) {
+			return slots[i];
+		}
+	}
+
+	Node node{ kind, op, false, lhs, rhs, value };
+	if (kind == FlatKind::Unary) {
+		node.value = apply_unary(op, nodes[lhs].value);
+		node.div_by_zero = nodes[lhs].div_by_zero;
+	}
+	else if (kind == FlatKind::Binary) {
+		node.value = apply_binary(op, nodes[lhs].value, nodes[rhs].value, node.div_by_zero);
+		node.div_by_zero |= nodes[lhs].div_by_zero || nodes[rhs].div_by_zero;
+	}
+	uint32_t id = (uint32_t)nodes.size();
+	nodes.push_back(node);
+	slots[i] = id;
+	created++;
+	return id;
+}
+
+const ExprDag::Node& ExprDag::add(const AstNode* root)
+{
+	struct Builder {
+		ExprDag& dag;
+		void number(const Value& v) { dag.ids.push_back(dag.intern(FlatKind::Number, TokenType::INTLTR, 0, 0, v)); }
+		void variable(uint32_t) { assert(0 && "an ExprDag has no variables"); }
+		void unary(TokenType o) {
+			// unary '+' changes nothing, sharing its operand shares more
+			if (o == TokenType::MINU) {
+				dag.ids.back() = dag.intern(FlatKind::Unary, o, dag.ids.back(), 0, Value());
+			}
+		}
+		void binary(TokenType o) {
+			uint32_t rhs = dag.ids.back();
+			dag.ids.pop_back();
+			dag.ids.back() = dag.intern(FlatKind::Binary, o, dag.ids.back(), rhs, Value());
+		}
+	};
+
+	if (nodes.size() > MAX_NODES) {
+		nodes.clear();
+		std::fill(slots.begin(), slots.end(), EMPTY);
+	}
+	ids.clear();
+	Builder b{ *this };
+	walk_postorder(root, b, walk);
+	return nodes[ids.back()];
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_X86_64
+#endif
+
+void JitCode::release()
+{
+#ifdef JIT_X86_64
+	if (map != nullptr) {
+		munmap(map, capacity);
+	}
+#endif
+	map = nullptr;
+	capacity = 0;
+}
+
+bool JitCode::compile(const AstNode* root)
+{
+#ifdef JIT_X86_64
+	struct Assembler {
+		std::vector<uint8_t>& code;
+		uint32_t depth;  // operands held, the top one in eax
+		uint32_t max_depth;
+		bool has_float;  // the code is int only, floats are left to the VM
+
+		void bytes(std::initializer_list<uint8_t> b) { code.insert(code.end(), b); }
+
+		// A short jump whose target is set by land()
+		size_t jump(uint8_t opcode) {
+			bytes({ opcode, 0 });
+			return code.size() - 1;
+		}
+		void land(size_t at) { code[at] = (uint8_t)(code.size() - at - 1); }
+
+		void number(const Value& v) {
+			has_float |= v.is_float;
+			if (depth > 0) {
+				bytes({ 0x50 });  // push rax
+			}
+			uint8_t imm[sizeof(int)];
+			std::memcpy(imm, &v.i, sizeof(int));
+			bytes({ 0xB8, imm[0], imm[1], imm[2], imm[3] });  // mov eax, v
+			depth++;
+			max_depth = std::max(max_depth, depth);
+		}
+
+		void variable(uint32_t) { assert(0 && "JitCode has no variables"); }
+
+		void unary(TokenType o) {
+			if (o == TokenType::MINU) {
+				bytes({ 0xF7, 0xD8 });  // neg eax
+			}
+		}
+
+		void binary(TokenType o) {
+			bytes({ 0x89, 0xC1, 0x58 });  // mov ecx, eax; pop rax
+			depth--;
+			switch (o) {
+			case TokenType::PLUS:
+				bytes({ 0x01, 0xC8 });  // add eax, ecx
+				break;
+			case TokenType::MINU:
+				bytes({ 0x29, 0xC8 });  // sub eax, ecx
+				break;
+			case TokenType::MULT:
+				bytes({ 0x0F, 0xAF, 0xC1 });  // imul eax, ecx
+				break;
+			case TokenType::DIV: {
+				// Same results as apply_binary: idiv traps on both x / 0 and INT_MIN / -1
+				bytes({ 0x85, 0xC9 });  // test ecx, ecx
+				size_t to_zero = jump(0x74);  // jz zero
+				bytes({ 0x83, 0xF9, 0xFF });  // cmp ecx, -1
+				size_t to_neg = jump(0x74);  // je neg
+				bytes({ 0x99, 0xF7, 0xF9 });  // cdq; idiv ecx
+				size_t done_1 = jump(0xEB);  // jmp done
+				land(to_neg);
+				bytes({ 0xF7, 0xD8 });  // neg: neg eax
+				size_t done_2 = jump(0xEB);  // jmp done
+				land(to_zero);
+				bytes({ 0xC6, 0x07, 0x01, 0x31, 0xC0 });  // zero: mov byte [rdi], 1; xor eax, eax
+				land(done_1);
+				land(done_2);
+				break;
+			}
+			default:
+				assert(0 && "invalid binary operator");
+			}
+		}
+	};
+
+	code.clear();
+	Assembler a{ code, 0, 0, false };
+	walk_postorder(root, a, walk);
+	a.bytes({ 0xC3 });  // ret
+	if (a.max_depth > MAX_STACK || a.has_float) {
+		return false;
+	}
+
+	if (code.size() > capacity) {
+		release();
+		size_t n = (code.size() + 4095) & ~(size_t)4095;
+		void* p = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			return false;
+		}
+		map = p;
+		capacity = n;
+	}
+	else if (mprotect(map, capacity, PROT_READ | PROT_WRITE) != 0) {
+		return false;
+	}
+	std::memcpy(map, code.data(), code.size());
+	return mprotect(map, capacity, PROT_READ | PROT_EXEC) == 0;
+#else
+	(void)root;
+	return false;
+#endif
+}
+
+}  // namespace expr
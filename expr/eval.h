@@ -0,0 +1,262 @@
+#ifndef EXPR_EVAL_H
+#define EXPR_EVAL_H
+
+#include<cstdint>
+#include<string>
+#include<string_view>
+#include<vector>
+
+#include "parser.h"
+
+namespace expr {
+
+enum class FlatKind : uint8_t {
+	Number,
+	Variable,  // an LVal, known by the index of its name in the NameTable of the DFA that lexed it
+	Unary,   // one operand: the node right before it
+	Binary   // two operands: the node right before it and the subtree before that one
+};
+
+// A compact AST as parallel arrays in post-order: every child comes before its parent, so the
+// subtree of node i is the range [first[i], i] and evaluation is one pass from left to right.
+// Parentheses, operator terminals and chain nodes are not stored.
+struct FlatAst {
+	std::vector<FlatKind> kind;
+	std::vector<TokenType> op;  // PLUS, MINU, MULT or DIV of a Unary or Binary node
+	std::vector<Value> value;  // the literal of a Number node, the name index of a Variable node as an int
+	std::vector<uint32_t> first;  // the first node of the subtree rooted here
+
+	size_t size() const { return kind.size(); }
+	void clear();
+
+	void push_number(const Value& v);
+	void push_variable(uint32_t name);
+	void push_unary(TokenType o);
+	void push_binary(TokenType o);
+
+	uint32_t right(uint32_t i) const { return i - 1; }
+	uint32_t left(uint32_t i) const { return first[i - 1] - 1; }
+
+	/**
+	  *  Func: Evaluate the whole tree, nodes are visited in storage order. The tree must have no Variable.
+	  *  @param[in] stack: The operands, owned by the caller and kept to save allocations, so that threads can
+	  *                    evaluate the same FlatAst at once with a stack each.
+	  *  @param[out] div_by_zero: Set if a division by zero was met.
+	  *  @return: The value of the last node, which is the root.
+	  */
+	Value evaluate(std::vector<Value>& stack, bool& div_by_zero) const;
+
+	std::vector<WalkItem> walk;  // scratch of flatten, kept to save allocations
+};
+
+/**
+  *  Func: Turn a tree built by the Parser into a FlatAst.
+  */
+void flatten(const AstNode* root, FlatAst& out);
+
+// Values of variables, one column per variable and one row per binding of all of them.
+// Read from a CSV file: a header line of names, then one line of int literals per row, '-' allowed in front.
+// A cell that is empty, not one whole int literal like 'x' or '12ab', or above UINT32_MAX is an error.
+struct ColumnTable {
+	std::vector<std::string> names;
+	std::vector<std::vector<int>> columns;
+	size_t rows = 0;
+
+	/**
+	  *  Func: Read the table from a file.
+	  *  @param[out] error: Why the file could not be read, if it could not.
+	  */
+	bool load(const char* path, std::string& error);
+
+	/**
+	  *  Func: The column of a variable, or -1 if there is none.
+	  */
+	int find(std::string_view name) const;
+};
+
+// Evaluates one expression for every row of a ColumnTable, a block of rows at a time:
+// each node of the FlatAst is one kernel call over the block.
+struct ColumnEvaluator {
+	static constexpr size_t MAX_BLOCK_ROWS = 1024;
+	static constexpr size_t SCRATCH_INTS = 1 << 21;  // bounds the scratch columns of deep expressions
+
+	/**
+	  *  Func: Get ready to evaluate flat over table.
+	  *  @param[in] names: The names the Variables of flat are indices into.
+	  *  @return: False if a variable of flat is not a column of table.
+	  */
+	bool compile(const FlatAst& flat, const ColumnTable& table, const NameTable& names);
+
+	/**
+	  *  Func: Evaluate the compiled expression for every row, it must not be is_float.
+	  *  @param[out] values: The value of each row.
+	  *  @param[out] div_by_zero: Nonzero for the rows that divided by zero, their value is meaningless.
+	  */
+	void run(const ColumnTable& table, std::vector<int>& values, std::vector<uint8_t>& div_by_zero);
+
+	/**
+	  *  Func: Evaluate the compiled expression for every row, one row after the other, it must be is_float.
+	  */
+	void run_float(const ColumnTable& table, std::vector<double>& values, std::vector<uint8_t>& div_by_zero);
+
+	bool is_float = false;  // a float literal takes part, so the value is a float
+
+private:
+	struct Step {
+		FlatKind kind;
+		TokenType op;
+		int arg;  // the literal of an int Number, the column of a Variable
+		Value literal;  // the literal of a Number
+	};
+
+	std::vector<Step> steps;
+	std::vector<Value> row_stack;  // operands of run_float
+	size_t max_stack = 0;
+	size_t block_rows = MAX_BLOCK_ROWS;
+	std::vector<int> scratch;  // max_stack columns of block_rows each
+	std::vector<const int*> operands;
+};
+
+// Instructions of a Program, each one byte long, Push is followed by its operand
+enum class OpCode : uint8_t {
+	Push,  // push the next 4 bytes as an int
+	Add,   // pop rhs and lhs, push lhs + rhs
+	Sub,
+	Mul,
+	Div,
+	Neg,   // negate the top of the stack
+	PushFloat,  // push the next 8 bytes as a double
+	AddFloat,   // like Add, on doubles
+	SubFloat,
+	MulFloat,
+	DivFloat,
+	NegFloat,
+	ToFloat,       // convert the int on top of the stack to double
+	ToFloatUnder,  // convert the int right below the top of the stack to double
+	Halt   // the top of the stack is the value of the program
+};
+
+// An expression compiled for a stack machine. Compile it once, then run it as often as needed,
+// from any number of threads at once as long as each runs it with its own Stack.
+struct Program {
+	// The type of an operand is known from the code, ints and doubles share the slots
+	union Slot {
+		int i;
+		double f;
+	};
+	typedef std::vector<Slot> Stack;
+
+	std::vector<uint8_t> code;
+	uint32_t max_stack = 0;  // the deepest the operand stack gets while running
+
+	void clear();
+
+	bool is_float = false;  // the type of the value of the program
+
+	void emit(OpCode op);
+	void emit_push(const Value& v);
+
+	/**
+	  *  Func: Run the program.
+	  *  @param[in] stack: The operands, owned by the caller and kept to save allocations, grown to max_stack.
+	  *  @param[out] div_by_zero: Set if a division by zero was met.
+	  *  @return: The value of the expression.
+	  */
+	Value run(Stack& stack, bool& div_by_zero) const;
+
+	uint32_t depth = 0;  // depth of the operand stack at the end of code, while compiling
+	std::vector<bool> types;  // is_float of each operand on the stack at the end of code, while compiling
+	std::vector<WalkItem> walk;  // scratch of compile, kept to save allocations
+};
+
+/**
+  *  Func: Compile a tree built by the Parser into a Program.
+  */
+void compile(const AstNode* root, Program& out);
+
+// Hash consing: every distinct subexpression is stored once with its value, however often it occurs.
+// Trees are added one after another and share the nodes of all the trees added before,
+// so the nodes form a DAG and a repeated subexpression is evaluated only the first time.
+struct ExprDag {
+	static constexpr size_t MAX_NODES = 1 << 22;  // the DAG is emptied before a tree when it has grown past this
+
+	struct Node {
+		FlatKind kind;
+		TokenType op;
+		bool div_by_zero;  // a division by zero was met evaluating this node
+		uint32_t lhs;  // the operand of a Unary node
+		uint32_t rhs;
+		Value value;
+	};
+
+	std::vector<Node> nodes;
+	uint64_t visited = 0;  // nodes of all the trees added, counting every occurrence
+	uint64_t created = 0;  // nodes that were not in the DAG yet
+
+	/**
+	  *  Func: Add a tree built by the Parser.
+	  *  @return: The node of the root, its value and div_by_zero are those of the tree.
+	  */
+	const Node& add(const AstNode* root);
+
+	/**
+	  *  Func: Occurrences per distinct node, 1 means nothing was shared.
+	  */
+	double sharing_ratio() const { return created == 0 ? 1.0 : (double)visited / (double)created; }
+
+private:
+	static constexpr uint32_t EMPTY = UINT32_MAX;
+
+	uint32_t intern(FlatKind kind, TokenType op, uint32_t lhs, uint32_t rhs, const Value& value);
+	void grow();
+
+	// Open addressing with linear probing, a slot holds the index of a node in nodes or EMPTY.
+	// The key of a node is its kind, op, lhs and rhs. A Number has its literal in lhs and rhs,
+	// the bits of a double or an int, and INTLTR or FLOATLTR as op.
+	std::vector<uint32_t> slots;
+	std::vector<uint32_t> ids;  // nodes of the operands while adding a tree
+	std::vector<WalkItem> walk;  // scratch of add, kept to save allocations
+};
+
+// An expression compiled to x86-64 machine code, in pages that are writable or executable but never both.
+// The code keeps the top of the operand stack in eax and the rest on the machine stack.
+struct JitCode {
+	// System V calling convention, *div_by_zero is set if a division by zero was met
+	typedef int (*Function)(bool* div_by_zero);
+
+	// Trees that need more operands than this at once are not compiled, to bound the machine stack used
+	static constexpr uint32_t MAX_STACK = 1 << 16;
+
+	JitCode() : code(), walk(), map(nullptr), capacity(0) {}
+	~JitCode() { release(); }
+
+	JitCode(const JitCode&) = delete;
+	JitCode& operator=(const JitCode&) = delete;
+
+	/**
+	  *  Func: Compile a tree built by the Parser, replacing the code compiled before.
+	  *  @return: False if there is no JIT for this platform, the tree is too deep or has a float literal,
+	  *           or the pages could not be had. There is no code to call then.
+	  */
+	bool compile(const AstNode* root);
+
+	/**
+	  *  Func: The compiled code, valid until the next compile() or the JitCode is gone.
+	  */
+	Function function() const { return reinterpret_cast<Function>(map); }
+
+	int run(bool& div_by_zero) const { return function()(&div_by_zero); }
+
+	std::vector<uint8_t> code;  // assembled here before it is copied to the pages
+	std::vector<WalkItem> walk;  // scratch of compile, kept to save allocations
+
+private:
+	void release();
+
+	void* map;  // the executable pages, kept from one compile to the next
+	size_t capacity;
+};
+
+}  // namespace expr
+
+#endif
@@ -0,0 +1,33 @@
+#include "expr.h"
+
+namespace expr {
+
+static LineEvaluator& thread_evaluator()
+{
+	static const Options options;
+	thread_local LineEvaluator evaluator(options);
+	return evaluator;
+}
+
+LineResult evaluate(std::string_view line)
+{
+	return thread_evaluator().evaluate_line(line);
+}
+
+void evaluate_many(std::span<const std::string_view> lines, std::span<LineResult> results)
+{
+	assert(results.size() == lines.size());
+	LineEvaluator& evaluator = thread_evaluator();
+	for (size_t i = 0; i < lines.size(); i++) {
+		results[i] = evaluator.evaluate_line(lines[i]);
+	}
+}
+
+std::vector<LineResult> evaluate_many(std::span<const std::string_view> lines)
+{
+	std::vector<LineResult> results(lines.size());
+	evaluate_many(lines, results);
+	return results;
+}
+
+}  // namespace expr
@@ -0,0 +1,37 @@
+#ifndef EXPR_EXPR_H
+#define EXPR_EXPR_H
+
+#include<span>
+#include<string_view>
+#include<vector>
+
+#include "incremental.h"
+#include "line_evaluator.h"
+
+namespace expr {
+
+// The library in one call: lex, parse and evaluate an expression in this process.
+// Every thread that calls in gets its own LineEvaluator on its first call and keeps it until it exits,
+// so calls from different threads share nothing and the later calls of a thread reuse the DFA, the
+// token vector and the Parser arena of the earlier ones instead of allocating them again.
+
+/**
+  *  Func: Evaluate one expression with the default Options.
+  *  @param[in] line: The expression, like '1 + 2 * (3 - 4)'.
+  *  @return: The value, or the error the programs print for the line. append_result turns it into that text.
+  */
+LineResult evaluate(std::string_view line);
+
+/**
+  *  Func: Evaluate the expressions in order with the LineEvaluator of the calling thread.
+  *  @param[out] results: One result per line, results.size() must be lines.size().
+  */
+void evaluate_many(std::span<const std::string_view> lines, std::span<LineResult> results);
+std::vector<LineResult> evaluate_many(std::span<const std::string_view> lines);
+
+// An expression that changes by small edits, like in an editor, is kept in an IncrementalExpr instead:
+// each edit costs about what it changes, not the length of the expression.
+
+}  // namespace expr
+
+#endif
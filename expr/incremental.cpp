@@ -0,0 +1,571 @@
+#include<algorithm>
+#include<cstring>
+
+#include "incremental.h"
+
+namespace expr {
+
+// The parser only sees the type and the decoded value of a token, and out_of_range
+static bool same_token(const Token& a, const Token& b)
+{
+	if (a.type != b.type || a.out_of_range != b.out_of_range) {
+		return false;
+	}
+	if (a.type == TokenType::FLOATLTR) {
+		return std::memcmp(&a.float_value, &b.float_value, sizeof(double)) == 0;
+	}
+	return a.value == b.value;
+}
+
+// now is the DFA at the new position of an old Snapshot, delta characters after it
+static bool same_state(const DFA::Snapshot& now, const DFA::Snapshot& old, ptrdiff_t delta)
+{
+	return now.state == old.state && now.head == old.head
+		&& (now.head.empty() || (now.offset == old.offset + delta && now.end == old.end + delta));
+}
+
+static bool is_chain(NodeType type)
+{
+	return type == NodeType::ADDEXP || type == NodeType::MULEXP;
+}
+
+static bool is_chain_op(NodeType type, TokenType t)
+{
+	if (type == NodeType::ADDEXP) {
+		return t == TokenType::PLUS || t == TokenType::MINU;
+	}
+	return t == TokenType::MULT || t == TokenType::DIV;
+}
+
+IncrementalExpr::IncrementalExpr(std::string_view text)
+	: last_edit(), source(text), token_array(), checkpoints(), dfa(), root(), root_ok(false), too_deep(false), fallback(token_array), cached()
+{
+	fallback.kind = ParserKind::Stack;
+	lex_all();
+	parse_all();
+}
+
+void IncrementalExpr::assign(std::string_view text)
+{
+	last_edit = EditStats();
+	source.assign(text.data(), text.size());
+	lex_all();
+	parse_all();
+}
+
+LineResult IncrementalExpr::result() const
+{
+	return cached;
+}
+
+void IncrementalExpr::edit(size_t begin, size_t end, std::string_view replacement)
+{
+	last_edit = EditStats();
+	begin = std::min(begin, source.size());
+	end = std::clamp(end, begin, source.size());
+	source.replace(begin, end - begin, replacement.data(), replacement.size());
+
+	size_t old_changed_end = 0;
+	size_t new_changed_end = 0;
+	const size_t first = relex(begin, end, replacement.size(), old_changed_end, new_changed_end);
+	if (too_deep) {
+		parse_all();
+		return;
+	}
+	reparse(first, old_changed_end, new_changed_end);
+	if (too_deep) {
+		parse_all();
+		return;
+	}
+	compute_result();
+}
+
+void IncrementalExpr::lex_all()
+{
+	token_array.clear();
+	checkpoints.clear();
+	dfa.reset();
+	auto sink = [this](const Token& tk, std::string_view) { token_array.push_back(tk); };
+	const size_t n = source.size();
+	for (size_t p = 0; ; p += CHECKPOINT_SIZE) {
+		checkpoints.push_back(Checkpoint{ (uint32_t)p, (uint32_t)token_array.size(), dfa.snapshot() });
+		const size_t stop = std::min(n, p + CHECKPOINT_SIZE);
+		dfa.scan(source.data() + p, stop - p, sink);
+		if (stop == n) {
+			break;
+		}
+	}
+	// The end of the text ends the last token like the end of a line
+	const char newline = '\n';
+	dfa.scan(&newline, 1, sink);
+	last_edit.lexed_bytes += n;
+}
+
+// The text is already edited: [begin, end) of the old text is [begin, begin + replacement_size) now.
+// The tokens are lexed again from the last Checkpoint at or before begin, until the DFA is where it was at an old
+// Checkpoint after the edit, every old token from that Checkpoint on is the same then, delta characters later.
+// Return the first token the parser has to look at again, old_changed_end and new_changed_end are where the
+// changed tokens end in the old and in the new token array.
+size_t IncrementalExpr::relex(size_t begin, size_t end, size_t replacement_size, size_t& old_changed_end, size_t& new_changed_end)
+{
+	const ptrdiff_t delta = (ptrdiff_t)replacement_size - (ptrdiff_t)(end - begin);
+	const size_t n = source.size();
+
+	// checkpoints[0] is at 0, so there is always one at or before begin
+	const size_t from = std::upper_bound(checkpoints.begin(), checkpoints.end(), begin,
+		[](size_t pos, const Checkpoint& c) { return pos < c.pos; }) - checkpoints.begin() - 1;
+	// The first old Checkpoint the DFA may meet again, its text up to the end of the input is unchanged
+	size_t k = std::lower_bound(checkpoints.begin(), checkpoints.end(), end,
+		[](const Checkpoint& c, size_t pos) { return c.pos < pos; }) - checkpoints.begin();
+	k = std::max(k, from + 1);
+
+	dfa.restore(checkpoints[from].dfa);
+	const size_t first_token = checkpoints[from].token_count;
+	std::vector<Token> fresh;
+	std::vector<Checkpoint> fresh_checkpoints;
+	auto sink = [&fresh](const Token& tk, std::string_view) { fresh.push_back(tk); };
+	bool synced = false;
+	size_t p = checkpoints[from].pos;
+	for (;;) {
+		DFA::Snapshot now = dfa.snapshot();
+		if (k < checkpoints.size() && (ptrdiff_t)checkpoints[k].pos + delta == (ptrdiff_t)p) {
+			if (same_state(now, checkpoints[k].dfa, delta)) {
+				synced = true;
+				break;
+			}
+			k++;
+		}
+		if (p == n) {
+			break;
+		}
+		if (p != checkpoints[from].pos) {
+			fresh_checkpoints.push_back(Checkpoint{ (uint32_t)p, (uint32_t)(first_token + fresh.size()), std::move(now) });
+		}
+		// Stop at the next old Checkpoint to compare with it
+		size_t stop = std::min(n, p + CHECKPOINT_SIZE);
+		if (k < checkpoints.size() && (ptrdiff_t)checkpoints[k].pos + delta < (ptrdiff_t)stop) {  // it is after p
+			stop = checkpoints[k].pos + delta;
+		}
+		dfa.scan(source.data() + p, stop - p, sink);
+		last_edit.lexed_bytes += stop - p;
+		p = stop;
+	}
+	if (!synced) {
+		const char newline = '\n';
+		dfa.scan(&newline, 1, sink);
+	}
+
+	// The old tokens [first_token, old_end) are fresh now
+	const size_t old_end = synced ? checkpoints[k].token_count : token_array.size();
+	const size_t new_end = first_token + fresh.size();
+	size_t first = first_token;
+	while (first < old_end && first < new_end && same_token(token_array[first], fresh[first - first_token])) {
+		first++;
+	}
+	old_changed_end = old_end;
+	new_changed_end = new_end;
+	while (old_changed_end > first && new_changed_end > first
+		&& same_token(token_array[old_changed_end - 1], fresh[new_changed_end - 1 - first_token])) {
+		old_changed_end--;
+		new_changed_end--;
+	}
+
+	// Move the tail once, and not at all if the edit kept the number of tokens
+	if (fresh.size() < old_end - first_token) {
+		token_array.erase(token_array.begin() + new_end, token_array.begin() + old_end);
+	}
+	else if (fresh.size() > old_end - first_token) {
+		token_array.insert(token_array.begin() + old_end, new_end - old_end, Token());
+	}
+	std::copy(fresh.begin(), fresh.end(), token_array.begin() + first_token);
+	if (delta != 0) {
+		for (size_t i = new_end; i < token_array.size(); i++) {
+			token_array[i].offset += delta;
+		}
+	}
+
+	const size_t tail = synced ? k : checkpoints.size();
+	const size_t kept = tail - from - 1;
+	if (fresh_checkpoints.size() < kept) {
+		checkpoints.erase(checkpoints.begin() + from + 1 + fresh_checkpoints.size(), checkpoints.begin() + tail);
+	}
+	else if (fresh_checkpoints.size() > kept) {
+		checkpoints.insert(checkpoints.begin() + tail, fresh_checkpoints.size() - kept, Checkpoint());
+	}
+	std::move(fresh_checkpoints.begin(), fresh_checkpoints.end(), checkpoints.begin() + from + 1);
+	const ptrdiff_t token_delta = (ptrdiff_t)new_end - (ptrdiff_t)old_end;
+	if (delta != 0 || token_delta != 0) {
+		for (size_t i = from + 1 + fresh_checkpoints.size(); i < checkpoints.size(); i++) {
+			Checkpoint& c = checkpoints[i];
+			c.pos += delta;
+			c.token_count += token_delta;
+			c.dfa.pos += delta;
+			if (!c.dfa.head.empty()) {
+				c.dfa.offset += delta;
+				c.dfa.end += delta;
+			}
+		}
+	}
+	return first;
+}
+
+void IncrementalExpr::parse_all()
+{
+	too_deep = false;
+	root.reset(new Node());
+	root->type = NodeType::ADDEXP;
+	size_t i = 0;
+	root_ok = parse_operands(NodeType::ADDEXP, true, i, 0, root->children, root->ops);
+	fold(*root, 0);
+	compute_result();
+}
+
+// Parse the tokens [first, old_end) of the old token array again, they are [first, new_end) now
+void IncrementalExpr::reparse(size_t first, size_t old_end, size_t new_end)
+{
+	if (first == old_end && old_end == new_end) {
+		return;
+	}
+	if (root_ok && first > root->tokens) {
+		return;  // after the expression, which leaves them alone
+	}
+	if (root->children.empty()) {
+		parse_all();
+		return;
+	}
+	const ptrdiff_t delta = (ptrdiff_t)new_end - (ptrdiff_t)old_end;
+
+	// Go down to the smallest subtree that holds every changed token
+	std::vector<PathStep> path;
+	bool last_holds = true;  // the child of the last step holds the change, else only its chain can be parsed again
+	Node* node = root.get();
+	uint32_t start = 0;
+	uint32_t depth = 0;
+	for (;;) {
+		size_t k = 0;
+		uint32_t child_start = start + 1;
+		if (is_chain(node->type)) {
+			// The last operand that starts at or before first
+			k = std::lower_bound(node->ends.begin(), node->ends.end(), (uint32_t)(first - start)) - node->ends.begin();
+			k = std::min(k, node->children.size() - 1);
+			child_start = start + node->child_start(k);
+		}
+		else if (node->type != NodeType::UNARYEXP && node->type != NodeType::PRIMARYEXP) {
+			break;  // a NUMBER or LVAL, its parent takes it
+		}
+		else {
+			depth++;
+		}
+		const uint32_t child_end = child_start + node->children[k]->tokens;
+		if (first < child_start || old_end > child_end) {
+			if (is_chain(node->type)) {
+				path.push_back(PathStep{ node, k, start, depth });
+				last_holds = false;
+			}
+			break;
+		}
+		path.push_back(PathStep{ node, k, start, depth });
+		node = node->children[k].get();
+		start = child_start;
+	}
+
+	for (size_t level = path.size(); level-- > 0;) {
+		if ((level + 1 < path.size() || last_holds) && reparse_child(path, level, delta)) {
+			return;
+		}
+		if (too_deep) {
+			return;
+		}
+		if (is_chain(path[level].node->type) && reparse_chain(path, level, delta)) {
+			return;
+		}
+		if (too_deep) {
+			return;
+		}
+	}
+	parse_all();
+}
+
+// Parse the child of path[level] again with its own production. It has to take exactly the tokens it took
+// before plus delta, then the rest of the tree parses as it did.
+bool IncrementalExpr::reparse_child(std::vector<PathStep>& path, size_t level, ptrdiff_t delta)
+{
+	Node& parent = *path[level].node;
+	const size_t k = path[level].child;
+	const Node& child = *parent.children[k];
+	const size_t child_start = path[level].start + (is_chain(parent.type) ? parent.child_start(k) : 1);
+	const ptrdiff_t expected = (ptrdiff_t)child.tokens + delta;
+	if (expected <= 0) {
+		return false;
+	}
+
+	size_t i = child_start;
+	std::unique_ptr<Node> fresh = is_chain(child.type) ? parse_chain(child.type, i, path[level].depth) : parse_factor(i, path[level].depth);
+	if (!fresh || (ptrdiff_t)(i - child_start) != expected) {
+		return false;
+	}
+	parent.children[k] = std::move(fresh);
+	refold_path(path, level, false);
+	return true;
+}
+
+// Parse the chain of path[level] again from the changed operand on. It has to end exactly where it ended
+// before plus delta, unless it is the root, which ends wherever it does.
+bool IncrementalExpr::reparse_chain(std::vector<PathStep>& path, size_t level, ptrdiff_t delta)
+{
+	Node& chain = *path[level].node;
+	const size_t k = path[level].child;
+	const bool is_root = (level == 0);
+	const ptrdiff_t expected = (ptrdiff_t)chain.tokens + delta;
+
+	std::vector<std::unique_ptr<Node>> children;
+	std::vector<TokenType> ops;
+	size_t i = path[level].start + (k == 0 ? 0 : chain.ends[k - 1]);
+	const bool ok = parse_operands(chain.type, k == 0, i, path[level].depth, children, ops);
+	if (too_deep) {
+		return false;
+	}
+	if (!is_root && (!ok || (ptrdiff_t)(i - path[level].start) != expected)) {
+		return false;
+	}
+
+	chain.children.resize(k);
+	chain.ops.resize(k == 0 ? 0 : k - 1);
+	chain.children.insert(chain.children.end(), std::make_move_iterator(children.begin()), std::make_move_iterator(children.end()));
+	chain.ops.insert(chain.ops.end(), ops.begin(), ops.end());
+	if (is_root) {
+		root_ok = ok;
+	}
+	refold_path(path, level, true);
+	return true;
+}
+
+// Fold the values again from path[level] up to the root, every chain from the operand the path goes through.
+// Only that operand changed, except in the chain of path[level] if its suffix was replaced.
+void IncrementalExpr::refold_path(std::vector<PathStep>& path, size_t level, bool suffix_replaced)
+{
+	for (size_t j = level + 1; j-- > 0;) {
+		Node& node = *path[j].node;
+		if (is_chain(node.type)) {
+			fold(node, std::min(path[j].child, node.children.size()), !(j == level && suffix_replaced));
+		}
+		else {
+			settle(node);
+		}
+	}
+}
+
+std::unique_ptr<IncrementalExpr::Node> IncrementalExpr::parse_chain(NodeType type, size_t& i, uint32_t depth)
+{
+	std::unique_ptr<Node> chain(new Node());
+	chain->type = type;
+	if (!parse_operands(type, true, i, depth, chain->children, chain->ops)) {
+		return nullptr;
+	}
+	fold(*chain, 0);
+	return chain;
+}
+
+// Parse the operands of a chain of type and append them to children, with the operators before them to ops.
+// i is at the first operand if first is set, at the operator before it if not. The operands parsed before a
+// missing one are appended too if it fails.
+bool IncrementalExpr::parse_operands(NodeType type, bool first, size_t& i, uint32_t depth, std::vector<std::unique_ptr<Node>>& children, std::vector<TokenType>& ops)
+{
+	if (first) {
+		std::unique_ptr<Node> operand = type == NodeType::ADDEXP ? parse_chain(NodeType::MULEXP, i, depth) : parse_factor(i, depth);
+		if (!operand) {
+			return false;
+		}
+		children.push_back(std::move(operand));
+	}
+	while (i < token_array.size() && is_chain_op(type, token_array[i].type)) {
+		const TokenType op = token_array[i].type;
+		size_t j = i + 1;
+		last_edit.parsed_tokens++;
+		std::unique_ptr<Node> operand = type == NodeType::ADDEXP ? parse_chain(NodeType::MULEXP, j, depth) : parse_factor(j, depth);
+		if (!operand) {
+			return false;
+		}
+		ops.push_back(op);
+		children.push_back(std::move(operand));
+		i = j;
+	}
+	return true;
+}
+
+std::unique_ptr<IncrementalExpr::Node> IncrementalExpr::parse_factor(size_t& i, uint32_t depth)
+{
+	if (depth >= MAX_RECURSION_DEPTH) {
+		too_deep = true;
+		return nullptr;
+	}
+	if (i >= token_array.size()) {
+		return nullptr;
+	}
+	const Token& tk = token_array[i];
+	std::unique_ptr<Node> node(new Node());
+	switch (tk.type) {
+	case TokenType::PLUS:
+	case TokenType::MINU: {
+		node->type = NodeType::UNARYEXP;
+		node->ops.push_back(tk.type);
+		i++;
+		last_edit.parsed_tokens++;
+		std::unique_ptr<Node> operand = parse_factor(i, depth + 1);
+		if (!operand) {
+			return nullptr;
+		}
+		node->children.push_back(std::move(operand));
+		break;
+	}
+	case TokenType::LPARENT: {
+		node->type = NodeType::PRIMARYEXP;
+		i++;
+		last_edit.parsed_tokens++;
+		std::unique_ptr<Node> inner = parse_chain(NodeType::ADDEXP, i, depth + 1);
+		if (!inner || i >= token_array.size() || token_array[i].type != TokenType::RPARENT) {
+			return nullptr;
+		}
+		i++;
+		last_edit.parsed_tokens++;
+		node->children.push_back(std::move(inner));
+		break;
+	}
+	case TokenType::INTLTR:
+	case TokenType::FLOATLTR:
+		node->type = NodeType::NUMBER;
+		node->tokens = 1;
+		node->value = literal_value(tk);
+		node->flags = tk.out_of_range ? OUT_OF_RANGE : 0;
+		i++;
+		last_edit.parsed_tokens++;
+		return node;
+	case TokenType::IDENT:
+		node->type = NodeType::LVAL;
+		node->tokens = 1;
+		node->flags = VARIABLE;
+		i++;
+		last_edit.parsed_tokens++;
+		return node;
+	default:
+		return nullptr;
+	}
+	settle(*node);
+	return node;
+}
+
+static bool same_value(const Value& a, const Value& b)
+{
+	if (a.is_float != b.is_float) {
+		return false;
+	}
+	return a.is_float ? std::memcmp(&a.f, &b.f, sizeof(double)) == 0 : a.i == b.i;
+}
+
+// Fold chain again from the operand from on. If rest_unchanged, the operands after it are the ones of the last
+// fold, so the fold can stop as soon as it is back to what it was, or move the rest by the same amount.
+void IncrementalExpr::fold(Node& chain, size_t from, bool rest_unchanged)
+{
+	const size_t count = chain.children.size();
+	chain.prefix.resize(count);
+	chain.prefix_flags.resize(count);
+	chain.ends.resize(count);
+	size_t k = from;
+	for (; k < count; k++) {
+		const Node& operand = *chain.children[k];
+		Value value = operand.value;
+		uint8_t flags = operand.flags;
+		uint32_t end = operand.tokens;
+		if (k > 0) {
+			bool div_by_zero = false;
+			value = apply_binary(chain.ops[k - 1], chain.prefix[k - 1], operand.value, div_by_zero);
+			flags |= chain.prefix_flags[k - 1] | (div_by_zero ? DIV_BY_ZERO : 0);
+			end += chain.ends[k - 1] + 1;
+		}
+		if (rest_unchanged && k > from && flags == chain.prefix_flags[k]) {
+			const uint32_t shift = end - chain.ends[k];
+			if (same_value(value, chain.prefix[k])) {
+				for (size_t j = k; j < count; j++) {
+					chain.ends[j] += shift;
+				}
+				break;
+			}
+			if (chain.type == NodeType::ADDEXP && !value.is_float && !chain.prefix[k].is_float) {
+				// '+' and '-' of ints wrap around, so each later int prefix moves as much as this one did.
+				// The first float one, if any, is folded again from there.
+				const unsigned moved = (unsigned)value.i - (unsigned)chain.prefix[k].i;
+				for (; k < count && !chain.prefix[k].is_float; k++) {
+					chain.prefix[k].i = (int)((unsigned)chain.prefix[k].i + moved);
+					chain.ends[k] += shift;
+				}
+				rest_unchanged = false;
+				k--;
+				continue;
+			}
+		}
+		chain.prefix[k] = value;
+		chain.prefix_flags[k] = flags;
+		chain.ends[k] = end;
+		last_edit.folded_operands++;
+	}
+	chain.value = count ? chain.prefix.back() : Value();
+	chain.flags = count ? chain.prefix_flags.back() : 0;
+	chain.tokens = count ? chain.ends.back() : 0;
+}
+
+// The value of a UNARYEXP or PRIMARYEXP from its only child
+void IncrementalExpr::settle(Node& node)
+{
+	const Node& child = *node.children[0];
+	node.flags = child.flags;
+	if (node.type == NodeType::UNARYEXP) {
+		node.tokens = child.tokens + 1;
+		node.value = apply_unary(node.ops[0], child.value);
+	}
+	else {
+		node.tokens = child.tokens + 2;
+		node.value = child.value;
+	}
+	last_edit.folded_operands++;
+}
+
+void IncrementalExpr::compute_result()
+{
+	if (too_deep) {
+		fallback.reset();
+		const AstNode* tree = fallback.get_abstract_syntax_tree();
+		if (tree == nullptr) {
+			cached = LineResult{ LineStatus::Invalid, Value() };
+		}
+		else if (fallback.literal_out_of_range) {
+			cached = LineResult{ LineStatus::OutOfRange, Value() };
+		}
+		else if (fallback.has_variable) {
+			cached = LineResult{ LineStatus::Unbound, Value() };
+		}
+		else if (fallback.div_by_zero) {
+			cached = LineResult{ LineStatus::DivByZero, Value() };
+		}
+		else {
+			cached = LineResult{ LineStatus::Value, tree->value };
+		}
+		return;
+	}
+	if (!root_ok || root->children.empty()) {
+		cached = LineResult{ LineStatus::Invalid, Value() };
+	}
+	else if (root->flags & OUT_OF_RANGE) {
+		cached = LineResult{ LineStatus::OutOfRange, Value() };
+	}
+	else if (root->flags & VARIABLE) {
+		cached = LineResult{ LineStatus::Unbound, Value() };
+	}
+	else if (root->flags & DIV_BY_ZERO) {
+		cached = LineResult{ LineStatus::DivByZero, Value() };
+	}
+	else {
+		cached = LineResult{ LineStatus::Value, root->value };
+	}
+}
+
+}  // namespace expr
@@ -0,0 +1,121 @@
+#ifndef EXPR_INCREMENTAL_H
+#define EXPR_INCREMENTAL_H
+
+#include<cstdint>
+#include<memory>
+#include<string>
+#include<string_view>
+#include<vector>
+
+#include "line_evaluator.h"
+
+namespace expr {
+
+// An expression that is edited over and over, like in an editor. It keeps its text, its tokens and its tree,
+// and an edit is lexed, parsed and evaluated again only as far as it changes them:
+//   - the DFA is restarted from the last Snapshot before the edit, Snapshots are taken every CHECKPOINT_SIZE
+//     characters, and lexing stops at the first Snapshot after the edit that equals the old one there;
+//   - the smallest subtree that holds the changed tokens is parsed again, or the rest of the chain of '+' and '-'
+//     or of '*' and '/' it is an operand of, as long as that takes exactly the tokens the old one took;
+//   - the values are folded again along the path from there to the root, each chain from the changed operand on.
+// The grammar and the values are those of parse_Pratt and parse_Stack: the tokens after a whole expression are
+// left alone, and a missing operand anywhere makes the expression invalid.
+// The text and the token array are still moved past the edit, but that is a memmove and not lexing.
+struct IncrementalExpr {
+	static constexpr size_t CHECKPOINT_SIZE = 64;
+
+	explicit IncrementalExpr(std::string_view text = std::string_view());
+
+	/**
+	  *  Func: Replace the characters in [begin, end) of the text with replacement.
+	  */
+	void edit(size_t begin, size_t end, std::string_view replacement);
+
+	/**
+	  *  Func: Replace the whole text, everything is lexed and parsed again.
+	  */
+	void assign(std::string_view text);
+
+	/**
+	  *  Func: The value of the expression, or the error homework2 prints for it.
+	  */
+	LineResult result() const;
+
+	const std::string& text() const { return source; }
+	const std::vector<Token>& tokens() const { return token_array; }
+
+	// How much the last edit did
+	struct EditStats {
+		uint64_t lexed_bytes = 0;
+		uint64_t parsed_tokens = 0;
+		uint64_t folded_operands = 0;
+	};
+	EditStats last_edit;
+
+private:
+	enum Flag : uint8_t {
+		DIV_BY_ZERO = 1,
+		VARIABLE = 2,
+		OUT_OF_RANGE = 4
+	};
+
+	// A node of the tree. All the operands of a chain of '+' and '-', or of '*' and '/', are children of one
+	// ADDEXP or MULEXP node, with the folded value and the length of the chain up to each of them.
+	struct Node {
+		NodeType type;  // ADDEXP, MULEXP, UNARYEXP, PRIMARYEXP for '(' ADDEXP ')', NUMBER or LVAL
+		uint32_t tokens = 0;  // number of tokens it spans
+		Value value = Value();
+		uint8_t flags = 0;  // of the whole subtree
+		std::vector<std::unique_ptr<Node>> children;
+		std::vector<TokenType> ops;  // of a chain, ops[i] is between children[i] and children[i + 1]; the operator of a UNARYEXP
+		std::vector<Value> prefix;  // of a chain, the value of children[0..i]
+		std::vector<uint8_t> prefix_flags;
+		std::vector<uint32_t> ends;  // of a chain, the tokens of children[0..i] and the operators between them
+
+		uint32_t child_start(size_t i) const { return i == 0 ? 0 : ends[i - 1] + 1; }
+	};
+
+	// Where the lexing of the text can go on from
+	struct Checkpoint {
+		uint32_t pos;
+		uint32_t token_count;  // tokens finished before pos
+		DFA::Snapshot dfa;
+	};
+
+	// A step of the path from the root to the subtree an edit falls in
+	struct PathStep {
+		Node* node;
+		size_t child;  // the index of the next node of the path in node->children
+		uint32_t start;  // the first token of node
+		uint32_t depth;  // '(' and unary operators around that next node
+	};
+
+	size_t relex(size_t begin, size_t end, size_t replacement_size, size_t& old_changed_end, size_t& new_changed_end);
+	void lex_all();
+	void parse_all();
+	void reparse(size_t first, size_t old_end, size_t new_end);
+	bool reparse_child(std::vector<PathStep>& path, size_t level, ptrdiff_t delta);
+	bool reparse_chain(std::vector<PathStep>& path, size_t level, ptrdiff_t delta);
+	void refold_path(std::vector<PathStep>& path, size_t level, bool suffix_replaced);
+
+	std::unique_ptr<Node> parse_chain(NodeType type, size_t& i, uint32_t depth);
+	bool parse_operands(NodeType type, bool first, size_t& i, uint32_t depth, std::vector<std::unique_ptr<Node>>& children, std::vector<TokenType>& ops);
+	std::unique_ptr<Node> parse_factor(size_t& i, uint32_t depth);
+	void fold(Node& chain, size_t from, bool rest_unchanged = false);
+	void settle(Node& node);
+	void compute_result();
+
+	std::string source;
+	std::vector<Token> token_array;
+	std::vector<Checkpoint> checkpoints;
+	DFA dfa;
+	std::unique_ptr<Node> root;  // an ADDEXP, the operands before a parse error are kept if root_ok is false
+	bool root_ok;
+	bool too_deep;  // nested deeper than MAX_RECURSION_DEPTH, result comes from a Parser then
+	Parser fallback;
+	LineResult cached;
+};
+
+}  // namespace expr
+
+#endif
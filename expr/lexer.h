@@ -0,0 +1,721 @@
+#ifndef EXPR_LEXER_H
+#define EXPR_LEXER_H
+
+#include<cassert>
+#include<cstdint>
+#include<cstdio>
+#include<cstring>
+#include<string>
+#include<string_view>
+#include<vector>
+
+#include "trace.h"
+
+namespace expr {
+
+bool decode_literal(std::string_view str, uint64_t& value);
+bool decode_float(std::string_view str, double& value);
+uint32_t name_hash(std::string_view name);
+
+enum class State
+{
+	Empty,       // space, \n, \r, ...
+	IntLiteral,  // decimal or octal literal, int or float, like '1', '01900', '1.5', '.5'
+	op,          // operators and '(', ')'.
+	opDone,      // an operator has just been emitted and nothing is buffered
+	Stray,       // an unknown character right after an operator, kept as the head of the next token
+	Word,        // identifier, like 'x', 'row2', or a literal with letters, like '0b11001', '12ab'
+	Zero,        // a literal that is '0' so far, '0x' makes it a hex one
+	HexLiteral,  // hex literal, int or float, like '0xAB', '0x1.8p3'
+	Exponent,    // right after the 'e' of a decimal literal or the 'p' of a hex one, a '+' or '-' may follow
+	ExpDigits    // the digits of an exponent
+};
+
+std::string toString(State s);
+
+// Every input byte is mapped to one of these classes before it is fed to the DFA
+enum class CharClass : uint8_t
+{
+	Space,    // ' ', ignored in every state
+	Letter,   // 'a'-'z', 'A'-'Z', but for the ones below
+	Open,     // '(', emitted at once in State::Empty like '-'
+	Op,       // '*', '/', ')'
+	Newline,  // '\n', ends the current token
+	Other,    // everything else
+	Digit,    // '1'-'9'
+	Zero,     // '0'
+	Dot,      // '.'
+	ExpE,     // 'e' and 'E', a decimal exponent or a hex digit
+	ExpP,     // 'p' and 'P', a hex exponent
+	HexX,     // 'x'
+	Minus,    // '-', the sign of an exponent or an operator
+	Plus      // '+', the sign of an exponent or an operator
+};
+
+// What the DFA does with the buffered characters on a transition
+enum class Action : uint8_t
+{
+	None,       // keep buffering
+	Begin,      // a new token begins at the input character
+	EmitInt,    // emit the buffered int literal, a new token begins at the input character
+	EmitOp,     // emit the buffered operator, a new token begins at the input character
+	EmitInput,  // emit the input character itself as an operator
+	EmitStray,  // emit the buffered stray character and the input character as one token
+	Drop        // forget the buffered characters
+};
+
+struct Transition
+{
+	State next;
+	Action action;
+};
+
+enum class TokenType : uint8_t
+{
+	INTLTR,   // int literal
+	PLUS,     // '+'
+	MINU,     // '-'
+	MULT,     // '*'
+	DIV,      // '/'
+	LPARENT,  // '('
+	RPARENT,  // ')'
+	IDENT,    // identifier, a letter followed by letters and digits
+	FLOATLTR  // float literal
+};
+
+std::string toString(TokenType type);
+
+// The name of each TokenType and the two spaces after it, as a line of output starts, without a std::string per token
+inline constexpr std::string_view token_line_prefix[] = {
+	"INTLTR  ", "PLUS  ", "MINU  ", "MULT  ", "DIV  ", "LPARENT  ", "RPARENT  ", "IDENT  ", "FLOATLTR  "
+};
+
+// A Token does not own its text, it points into the buffer it was lexed from.
+// Literals are decoded by the DFA, so the parser never looks at the text again.
+struct Token
+{
+	uint32_t offset;       // position of the first character, counted from the last DFA::reset
+	uint32_t length : 23;  // number of input characters the token spans
+	uint32_t out_of_range : 1;  // an INTLTR above UINT32_MAX or a FLOATLTR that is infinite
+	TokenType type : 8;
+	union {
+		int value;           // decoded value of an INTLTR, the index of the name of an IDENT in DFA::names, 0 for operators
+		double float_value;  // decoded value of a FLOATLTR
+	};
+};
+
+static_assert(sizeof(Token) <= 16, "Token should stay small");
+
+/**
+  *  Func: Get the text of a Token.
+  *  @param[in] source: The buffer the Token was lexed from.
+  *  @param[in] tk: The Token.
+  *  @param[out] scratch: Holds the text if the token has spaces inside, like '1 2'
+  *  @return: The text of the Token, spaces excluded.
+  */
+std::string_view token_text(const char* source, const Token& tk, std::string& scratch);
+
+// Each name once, in the order they came. Names are told apart by their whole text, the hash only finds them.
+struct NameTable {
+	NameTable() : chars(), starts(1, 0), hashes(), slots() {}
+
+	/**
+	  *  Func: The index of name, added if it is not there yet. The views name() gave before may move then.
+	  */
+	uint32_t intern(std::string_view name);
+
+	std::string_view name(uint32_t id) const { return std::string_view(chars.data() + starts[id], starts[id + 1] - starts[id]); }
+	size_t size() const { return hashes.size(); }
+
+	void clear();
+
+private:
+	void rehash(size_t slot_count);
+
+	std::string chars;  // the names one after the other
+	std::vector<uint32_t> starts;  // name i is chars[starts[i], starts[i + 1])
+	std::vector<uint32_t> hashes;  // name_hash of each name
+	std::vector<uint32_t> slots;  // open addressing on the hash, the index of a name plus 1, 0 if free
+};
+
+struct  DFA {
+	DFA();
+	~DFA();
+
+	// Do not allow copy and assignment
+	DFA(const DFA&) = delete;
+	DFA& operator=(const DFA&) = delete;
+
+	/**
+	  *  Name: next
+	  *  Func: Take a char as input, change state to next state, and output a Token if necessary.
+	  *  @param[in] input: The input character.
+	  *  @param[out] buf: The output Token buffer
+	  *  @return: True if a Token is produced, i.e. the buf is valid.
+	  */
+	bool next(char input, Token& buf);
+
+	/**
+	  *  Name: lex
+	  *  Func: Feed a whole buffer to the DFA and append every produced Token to tokens.
+	  *        A token that is still open at the end of the buffer is carried over to the next call.
+	  *  @param[in] input: The input buffer.
+	  *  @param[in] n: The length of the input buffer.
+	  *  @param[out] tokens: The output Token stream, offsets count from the last reset()
+	  */
+	void lex(const char* input, size_t n, std::vector<Token>& tokens);
+	void lex(const std::string& input, std::vector<Token>& tokens) { lex(input.data(), input.size(), tokens); }
+
+	/**
+	  *  Func: Reset the DFA state to begin, names is emptied too.
+	  */
+	void reset();
+
+	NameTable names;  // of the IDENT tokens since the last reset(), which lex_lines and TokenPuller do at each line
+
+	// Everything the DFA carries from one scan to the next: lexing can go on from a Snapshot taken
+	// between two scans as if the input had never stopped there
+	struct Snapshot {
+		State state;
+		std::string head;  // of the open token, empty if there is none
+		uint32_t offset;  // of the open token
+		uint32_t end;
+		uint32_t pos;
+	};
+
+	Snapshot snapshot() const { return Snapshot{ cur_state, cur_str, cur_offset, cur_end, pos }; }
+	void restore(const Snapshot& s) {
+		cur_state = s.state;
+		cur_str = s.head;
+		cur_offset = s.offset;
+		cur_end = s.end;
+		pos = s.pos;
+	}
+
+	/**
+	  *  Name: scan
+	  *  Func: Feed a buffer to the DFA and hand every produced Token to sink.
+	  *  @param[in] input: The input buffer.
+	  *  @param[in] n: The length of the input buffer.
+	  *  @param[in] sink: Called as sink(const Token&, std::string_view text), the text is only valid during the call
+	  */
+	template <typename Sink>
+	void scan(const char* input, size_t n, Sink&& sink);
+
+private:
+	std::string_view make_token(TokenType type, const char* input, size_t first, size_t last, Token& buf);
+
+	State cur_state;  // Record current state of the DFA
+	std::string cur_str;  // Head of a token that is still open at the end of the last input
+	uint32_t cur_offset;  // Offset of the open token, valid if cur_str is not empty
+	uint32_t cur_end;  // Offset just past the last non-space character of cur_str
+	uint32_t pos;  // Number of characters consumed since reset()
+};
+
+struct CharClassTable
+{
+	CharClass cls[256];
+	TokenType op_type[256];
+
+	constexpr CharClassTable() : cls(), op_type()
+	{
+		for (int c = 0; c < 256; c++) {
+			cls[c] = CharClass::Other;
+			op_type[c] = TokenType::INTLTR;
+		}
+		for (int c = 'a'; c <= 'z'; c++) cls[c] = CharClass::Letter;
+		for (int c = 'A'; c <= 'Z'; c++) cls[c] = CharClass::Letter;
+		for (int c = '1'; c <= '9'; c++) cls[c] = CharClass::Digit;
+		cls['0'] = CharClass::Zero;
+		cls['.'] = CharClass::Dot;
+		cls['e'] = CharClass::ExpE;
+		cls['E'] = CharClass::ExpE;
+		cls['p'] = CharClass::ExpP;
+		cls['P'] = CharClass::ExpP;
+		cls['x'] = CharClass::HexX;
+		cls[' '] = CharClass::Space;
+		cls['\n'] = CharClass::Newline;
+		cls['('] = CharClass::Open;
+		cls['-'] = CharClass::Minus;
+		cls['+'] = CharClass::Plus;
+		cls['*'] = CharClass::Op;
+		cls['/'] = CharClass::Op;
+		cls[')'] = CharClass::Op;
+
+		op_type['+'] = TokenType::PLUS;
+		op_type['-'] = TokenType::MINU;
+		op_type['*'] = TokenType::MULT;
+		op_type['/'] = TokenType::DIV;
+		op_type['('] = TokenType::LPARENT;
+		op_type[')'] = TokenType::RPARENT;
+	}
+};
+
+inline constexpr CharClassTable char_table;
+
+// ASCII letters and digits, the same in every locale unlike std::isalpha. Not the char_table classes, which keep
+// 'e', 'p' and 'x' apart from the other letters.
+inline bool is_ascii_letter(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+inline bool is_ascii_alnum(char c)
+{
+	return is_ascii_letter(c) || (c >= '0' && c <= '9');
+}
+
+constexpr int STATE_COUNT = 10;
+constexpr int CHAR_CLASS_COUNT = 14;
+
+// dfa_table[state][char class], the columns are Space, Letter, Open, Op, Newline, Other,
+// Digit, Zero, Dot, ExpE, ExpP, HexX, Minus, Plus
+inline constexpr Transition dfa_table[STATE_COUNT][CHAR_CLASS_COUNT] = {
+	// State::Empty
+	{ { State::Empty, Action::None }, { State::Word, Action::Begin }, { State::opDone, Action::EmitInput }, { State::Empty, Action::None },
+	  { State::Empty, Action::None }, { State::Empty, Action::None }, { State::IntLiteral, Action::Begin }, { State::Zero, Action::Begin },
+	  { State::IntLiteral, Action::Begin }, { State::Word, Action::Begin }, { State::Word, Action::Begin }, { State::Word, Action::Begin },
+	  { State::opDone, Action::EmitInput }, { State::Empty, Action::None } },
+	// State::IntLiteral
+	{ { State::IntLiteral, Action::None }, { State::Word, Action::None }, { State::op, Action::EmitInt }, { State::op, Action::EmitInt },
+	  { State::Empty, Action::EmitInt }, { State::Empty, Action::Drop }, { State::IntLiteral, Action::None }, { State::IntLiteral, Action::None },
+	  { State::IntLiteral, Action::None }, { State::Exponent, Action::None }, { State::Word, Action::None }, { State::Word, Action::None },
+	  { State::op, Action::EmitInt }, { State::op, Action::EmitInt } },
+	// State::op
+	{ { State::op, Action::None }, { State::Word, Action::EmitOp }, { State::op, Action::EmitOp }, { State::op, Action::EmitOp },
+	  { State::Empty, Action::EmitOp }, { State::Stray, Action::EmitOp }, { State::IntLiteral, Action::EmitOp }, { State::Zero, Action::EmitOp },
+	  { State::IntLiteral, Action::EmitOp }, { State::Word, Action::EmitOp }, { State::Word, Action::EmitOp }, { State::Word, Action::EmitOp },
+	  { State::op, Action::EmitOp }, { State::op, Action::EmitOp } },
+	// State::opDone
+	{ { State::opDone, Action::None }, { State::Word, Action::Begin }, { State::opDone, Action::EmitInput }, { State::opDone, Action::EmitInput },
+	  { State::Empty, Action::None }, { State::Empty, Action::None }, { State::IntLiteral, Action::Begin }, { State::Zero, Action::Begin },
+	  { State::IntLiteral, Action::Begin }, { State::Word, Action::Begin }, { State::Word, Action::Begin }, { State::Word, Action::Begin },
+	  { State::opDone, Action::EmitInput }, { State::opDone, Action::EmitInput } },
+	// State::Stray
+	{ { State::Stray, Action::None }, { State::Word, Action::None }, { State::opDone, Action::EmitStray }, { State::Empty, Action::Drop },
+	  { State::Empty, Action::Drop }, { State::Empty, Action::Drop }, { State::Word, Action::None }, { State::Word, Action::None },
+	  { State::Empty, Action::Drop }, { State::Word, Action::None }, { State::Word, Action::None }, { State::Word, Action::None },
+	  { State::opDone, Action::EmitStray }, { State::Empty, Action::Drop } },
+	// State::Word
+	{ { State::Word, Action::None }, { State::Word, Action::None }, { State::op, Action::EmitInt }, { State::op, Action::EmitInt },
+	  { State::Empty, Action::EmitInt }, { State::Empty, Action::Drop }, { State::Word, Action::None }, { State::Word, Action::None },
+	  { State::Empty, Action::Drop }, { State::Word, Action::None }, { State::Word, Action::None }, { State::Word, Action::None },
+	  { State::op, Action::EmitInt }, { State::op, Action::EmitInt } },
+	// State::Zero
+	{ { State::Zero, Action::None }, { State::Word, Action::None }, { State::op, Action::EmitInt }, { State::op, Action::EmitInt },
+	  { State::Empty, Action::EmitInt }, { State::Empty, Action::Drop }, { State::IntLiteral, Action::None }, { State::IntLiteral, Action::None },
+	  { State::IntLiteral, Action::None }, { State::Exponent, Action::None }, { State::Word, Action::None }, { State::HexLiteral, Action::None },
+	  { State::op, Action::EmitInt }, { State::op, Action::EmitInt } },
+	// State::HexLiteral
+	{ { State::HexLiteral, Action::None }, { State::HexLiteral, Action::None }, { State::op, Action::EmitInt }, { State::op, Action::EmitInt },
+	  { State::Empty, Action::EmitInt }, { State::Empty, Action::Drop }, { State::HexLiteral, Action::None }, { State::HexLiteral, Action::None },
+	  { State::HexLiteral, Action::None }, { State::HexLiteral, Action::None }, { State::Exponent, Action::None }, { State::HexLiteral, Action::None },
+	  { State::op, Action::EmitInt }, { State::op, Action::EmitInt } },
+	// State::Exponent
+	{ { State::Exponent, Action::None }, { State::ExpDigits, Action::None }, { State::op, Action::EmitInt }, { State::op, Action::EmitInt },
+	  { State::Empty, Action::EmitInt }, { State::Empty, Action::Drop }, { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None },
+	  { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None },
+	  { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None } },
+	// State::ExpDigits
+	{ { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None }, { State::op, Action::EmitInt }, { State::op, Action::EmitInt },
+	  { State::Empty, Action::EmitInt }, { State::Empty, Action::Drop }, { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None },
+	  { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None }, { State::ExpDigits, Action::None },
+	  { State::op, Action::EmitInt }, { State::op, Action::EmitInt } },
+};
+
+// Append [first, last) to dst, spaces inside a token are skipped just like everywhere else
+inline void append_token_chars(std::string& dst, const char* first, const char* last)
+{
+	for (const char* p = first; p != last; p++) {
+		if (*p != ' ') {
+			dst += *p;
+		}
+	}
+}
+
+// Run scanners: return the first position in [i, n) whose character does not continue the run.
+// A run of spaces never changes the DFA state, neither does a run of letters, digits and spaces in
+// State::Word, a run of digits and spaces in State::IntLiteral and State::ExpDigits, nor a run of hex
+// digits and spaces in State::HexLiteral, so DFA::scan skips such runs with the widest scanner the CPU has.
+typedef size_t (*RunScanner)(const char* input, size_t i, size_t n);
+
+struct RunScanners
+{
+	RunScanner spaces;
+	RunScanner literal;
+	RunScanner digits;
+	RunScanner hex;
+	const char* name;
+};
+
+extern const RunScanners run_scanners;  // the widest ones the CPU has
+
+template <typename Sink>
+void DFA::scan(const char* input, size_t n, Sink&& sink)
+{
+	// The open token is cur_str followed by input[begin, i)
+	size_t begin = 0;
+
+	auto emit = [&](TokenType type, size_t first, size_t last) {
+		Token tk;
+		std::string_view text = make_token(type, input, first, last, tk);
+		sink(tk, text);
+		cur_str.clear();
+	};
+
+	for (size_t i = 0; i < n; i++) {
+		if (cur_state == State::Word) {
+			i = run_scanners.literal(input, i, n);
+			if (i == n) {
+				break;
+			}
+		}
+		else if (cur_state == State::IntLiteral || cur_state == State::ExpDigits) {
+			i = run_scanners.digits(input, i, n);
+			if (i == n) {
+				break;
+			}
+		}
+		else if (cur_state == State::HexLiteral) {
+			i = run_scanners.hex(input, i, n);
+			if (i == n) {
+				break;
+			}
+		}
+		else if (input[i] == ' ') {
+			i = run_scanners.spaces(input, i, n);
+			if (i == n) {
+				break;
+			}
+		}
+
+		const CharClass cls = char_table.cls[(unsigned char)input[i]];
+		const Transition t = dfa_table[(int)cur_state][(int)cls];
+		cur_state = t.next;
+
+		switch (t.action) {
+		case Action::None:
+			break;
+		case Action::Begin:
+			begin = i;
+			break;
+		case Action::EmitInt:
+			emit(TokenType::INTLTR, begin, i);
+			begin = i;
+			break;
+		case Action::EmitOp: {
+			char c = cur_str.empty() ? input[begin] : cur_str[0];
+			emit(char_table.op_type[(unsigned char)c], begin, i);
+			begin = i;
+			break;
+		}
+		case Action::EmitInput:
+			emit(char_table.op_type[(unsigned char)input[i]], i, i + 1);
+			break;
+		case Action::EmitStray:
+			emit(TokenType::INTLTR, begin, i + 1);
+			break;
+		case Action::Drop:
+			cur_str.clear();
+			break;
+		}
+	}
+
+	if (cur_state != State::Empty && cur_state != State::opDone) {
+		if (cur_str.empty()) {
+			cur_offset = pos + (uint32_t)begin;
+		}
+		append_token_chars(cur_str, input + begin, input + n);
+		size_t last = n;
+		while (last > begin && input[last - 1] == ' ') {
+			last--;
+		}
+		if (last > begin) {
+			cur_end = pos + (uint32_t)last;
+		}
+	}
+	else {
+		cur_str.clear();
+	}
+	pos += (uint32_t)n;
+}
+
+// Input is consumed in chunks: a regular file is mapped into memory as one chunk,
+// anything else (a pipe, a terminal) is read in fixed-size chunks into a reused buffer.
+struct InputReader {
+	static constexpr size_t CHUNK_SIZE = 1 << 16;
+
+	/**
+	  *  @param[in] path: The file to read, or nullptr to read stdin.
+	  */
+	explicit InputReader(const char* path);
+	~InputReader();
+
+	InputReader(const InputReader&) = delete;
+	InputReader& operator=(const InputReader&) = delete;
+
+	/**
+	  *  Func: Check if the input was opened successfully.
+	  */
+	bool ok() const { return file != nullptr || map != nullptr; }
+
+	/**
+	  *  Func: Check if the whole input is mapped, then next_chunk returns it in one piece.
+	  */
+	bool mapped() const { return map != nullptr; }
+
+	/**
+	  *  Name: next_chunk
+	  *  Func: Get the next chunk of input, it stays valid until the next call.
+	  *  @param[out] data: The first character of the chunk.
+	  *  @param[out] size: The length of the chunk.
+	  *  @return: False at the end of input.
+	  */
+	bool next_chunk(const char*& data, size_t& size);
+
+private:
+	FILE* file;  // Read in chunks from here if the input is not mapped
+	const char* map;  // The whole input if it is mapped
+	size_t map_size;
+	bool map_taken;  // The mapping has been handed out by next_chunk
+	std::vector<char> buf;
+};
+
+/**
+  *  Name: lex_lines
+  *  Func: Run the DFA over the whole input and report the end of every line.
+  *        Chunks are fed to the DFA as they come, a token cut by a chunk boundary is carried over
+  *        by the DFA itself. The DFA is reset after each line, so token offsets count from the line start.
+  *        A '\r' in front of a '\n' is dropped, and a last line without '\n' still gets one.
+  *  @param[in] in: The input, anything with a next_chunk like InputReader.
+  *  @param[in] dfa: The DFA to drive.
+  *  @param[in] on_token: Called as on_token(const Token&, std::string_view text) for every Token.
+  *  @param[in] on_line: Called after the '\n' of every line has been fed to the DFA.
+  */
+template <typename Source, typename OnToken, typename OnLine>
+void lex_lines(Source& in, DFA& dfa, OnToken&& on_token, OnLine&& on_line)
+{
+	static const char newline = '\n';
+	static const char carriage_return = '\r';
+
+	bool line_open = false;  // Some characters of the current line have been fed
+	bool pending_cr = false;  // The last chunk ended with a '\r' that was held back
+	const char* data;
+	size_t size;
+
+	dfa.reset();
+	while (in.next_chunk(data, size)) {
+		const char* p = data;
+		const char* end = data + size;
+
+		if (pending_cr && *p != '\n') {
+			dfa.scan(&carriage_return, 1, on_token);
+		}
+		pending_cr = false;
+
+		while (p != end) {
+			const char* nl = (const char*)std::memchr(p, '\n', end - p);
+			if (nl == nullptr) {
+				const char* last = end;
+				if (last[-1] == '\r') {
+					last--;
+					pending_cr = true;
+				}
+				dfa.scan(p, last - p, on_token);
+				line_open = true;
+				break;
+			}
+
+			const char* last = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+			{
+				TRACE_SCOPE("lex");
+				dfa.scan(p, last - p, on_token);
+				dfa.scan(&newline, 1, on_token);
+			}
+			on_line();
+			dfa.reset();
+			line_open = false;
+			p = nl + 1;
+		}
+	}
+
+	if (pending_cr) {
+		dfa.scan(&carriage_return, 1, on_token);
+	}
+	if (line_open || pending_cr) {
+		dfa.scan(&newline, 1, on_token);
+		on_line();
+		dfa.reset();
+	}
+}
+
+// Input that is already in memory, handed out as one chunk
+struct MemoryInput {
+	const char* data;
+	size_t size;
+	bool taken;
+
+	MemoryInput(const char* data, size_t size) : data(data), size(size), taken(false) {}
+
+	bool next_chunk(const char*& chunk, size_t& chunk_size)
+	{
+		if (taken || size == 0) {
+			return false;
+		}
+		taken = true;
+		chunk = data;
+		chunk_size = size;
+		return true;
+	}
+};
+
+/**
+  *  Name: TokenPuller
+  *  Func: The pull side of lex_lines. The parser asks for one Token at a time and the DFA is fed just
+  *        one more slice of the line whenever the lookahead runs dry, so no line is ever lexed as a whole.
+  *        Lines, '\r' and chunk boundaries are treated exactly like lex_lines does.
+  *  @param[in] in: The input, anything with a next_chunk like InputReader.
+  *  @param[in] on_token: Called as on_token(const Token&, std::string_view text) as each Token is lexed.
+  */
+template <typename Source, typename OnToken>
+struct TokenPuller {
+	static constexpr size_t SLICE_SIZE = 256;
+
+	TokenPuller(Source& in, DFA& dfa, OnToken& on_token)
+		: in(in), dfa(dfa), on_token(on_token), p(nullptr), end(nullptr), pending_cr(false), line_done(true), lookahead(), head(0) {}
+
+	/**
+	  *  Func: Move on to the next line, the current one must have been read to its end.
+	  *  @return: False at the end of input.
+	  */
+	bool next_line();
+
+	/**
+	  *  Func: The next Token of the line, or nullptr at the end of the line. It stays valid until advance().
+	  */
+	const Token* peek() {
+		while (head == lookahead.size()) {
+			lookahead.clear();
+			head = 0;
+			if (!fill()) {
+				return nullptr;
+			}
+		}
+		return &lookahead[head];
+	}
+
+	void advance() { head++; }
+
+	/**
+	  *  Func: Lex the rest of the line, its Tokens still go to on_token.
+	  */
+	void skip_line() {
+		while (fill()) {}
+		lookahead.clear();
+		head = 0;
+	}
+
+private:
+	bool load_chunk();
+	bool fill();
+
+	Source& in;
+	DFA& dfa;
+	OnToken& on_token;
+	const char* p;  // the part of the current chunk not fed yet is [p, end)
+	const char* end;
+	bool pending_cr;  // the last chunk ended with a '\r' that was held back
+	bool line_done;  // the '\n' of the line has been fed
+	std::vector<Token> lookahead;  // Tokens of the last slice, from head on not yet read
+	size_t head;
+};
+
+template <typename Source, typename OnToken>
+bool TokenPuller<Source, OnToken>::next_line()
+{
+	assert(line_done && "the current line has not been read to its end");
+	dfa.reset();
+	lookahead.clear();
+	head = 0;
+	if (p == end && !load_chunk()) {
+		return false;
+	}
+	line_done = false;
+	return true;
+}
+
+template <typename Source, typename OnToken>
+bool TokenPuller<Source, OnToken>::load_chunk()
+{
+	static const char carriage_return = '\r';
+
+	size_t size;
+	if (!in.next_chunk(p, size)) {
+		p = end = nullptr;
+		return false;
+	}
+	end = p + size;
+	if (pending_cr && *p != '\n') {
+		dfa.scan(&carriage_return, 1, [this](const Token& tk, std::string_view text) {
+			on_token(tk, text);
+			lookahead.push_back(tk);
+		});
+	}
+	pending_cr = false;
+	return true;
+}
+
+// Feed the next slice of the line to the DFA, false if the line was done already
+template <typename Source, typename OnToken>
+bool TokenPuller<Source, OnToken>::fill()
+{
+	static const char newline = '\n';
+	static const char carriage_return = '\r';
+
+	if (line_done) {
+		return false;
+	}
+	TRACE_SCOPE("lex");
+	auto sink = [this](const Token& tk, std::string_view text) {
+		on_token(tk, text);
+		lookahead.push_back(tk);
+	};
+
+	if (p == end && !load_chunk()) {
+		// A last line without '\n' still gets one
+		if (pending_cr) {
+			dfa.scan(&carriage_return, 1, sink);
+			pending_cr = false;
+		}
+		dfa.scan(&newline, 1, sink);
+		line_done = true;
+		return true;
+	}
+
+	size_t n = std::min((size_t)(end - p), SLICE_SIZE);
+	if (p[n - 1] == '\r' && p + n < end) {
+		n++;  // do not cut a "\r\n" in two
+	}
+	const char* nl = (const char*)std::memchr(p, '\n', n);
+	if (nl != nullptr) {
+		const char* last = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+		dfa.scan(p, last - p, sink);
+		dfa.scan(&newline, 1, sink);
+		line_done = true;
+		p = nl + 1;
+	}
+	else if (p + n == end && end[-1] == '\r') {
+		dfa.scan(p, n - 1, sink);
+		pending_cr = true;
+		p = end;
+	}
+	else {
+		dfa.scan(p, n, sink);
+		p += n;
+	}
+	return true;
+}
+
+}  // namespace expr
+
+#endif
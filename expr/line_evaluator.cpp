@@ -0,0 +1,493 @@
+#include<algorithm>
+#include<charconv>
+#include<cmath>
+#include<cstring>
+
+#include "line_evaluator.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define INPUT_MMAP
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+namespace expr {
+
+CacheKey cache_key(const std::vector<Token>& tokens, const NameTable& names, uint64_t seed)
+{
+	uint64_t hi = 0x243F6A8885A308D3ull ^ seed;
+	uint64_t lo = 0x13198A2E03707344ull + tokens.size();
+	for (const Token& tk : tokens) {
+		uint64_t x = (uint64_t)tk.out_of_range << 40 | (uint64_t)tk.type << 32;
+		if (tk.type == TokenType::FLOATLTR) {
+			uint64_t bits;
+			std::memcpy(&bits, &tk.float_value, sizeof(bits));
+			x ^= bits * 0xD6E8FEB86659FD93ull;
+		}
+		else if (tk.type == TokenType::IDENT) {
+			// The index tells the names of the line apart, the text tells them from those of other lines
+			uint64_t h = 0xCBF29CE484222325ull;
+			for (char c : names.name((uint32_t)tk.value)) {
+				h = (h ^ (unsigned char)c) * 0x100000001B3ull;
+			}
+			x ^= h * 0xD6E8FEB86659FD93ull;
+			x |= (uint32_t)tk.value;
+		}
+		else {
+			x |= (uint32_t)tk.value;
+		}
+		hi = (hi ^ x) * 0x9E3779B97F4A7C15ull;
+		hi ^= hi >> 31;
+		lo = (lo + x) * 0xC2B2AE3D27D4EB4Full;
+		lo ^= lo >> 29;
+	}
+	hi ^= lo * 0x165667B19E3779F9ull;
+	lo ^= hi >> 33;
+	return CacheKey{ hi, lo };
+}
+
+bool ResultCache::find(const CacheKey& key, LineResult& result)
+{
+	auto it = index.find(key);
+	if (it == index.end()) {
+		return false;
+	}
+	order.splice(order.begin(), order, it->second);
+	result = it->second->result;
+	return true;
+}
+
+void ResultCache::put(const CacheKey& key, const LineResult& result)
+{
+	if (capacity == 0) {
+		return;
+	}
+	if (order.size() == capacity) {
+		index.erase(order.back().key);
+		order.pop_back();
+	}
+	order.push_front(Entry{ key, result });
+	index.emplace(key, order.begin());
+}
+
+DiskCache::DiskCache(const char* path) : lock(), map(nullptr), map_size(0), slots(nullptr), slot_count(0)
+{
+#ifdef INPUT_MMAP
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == 0) {
+		// A new file, its slots are all zero, which means free
+		Header header;
+		std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.slot_count = SLOT_COUNT;
+		if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+			ftruncate(fd, (off_t)(sizeof(Header) + SLOT_COUNT * sizeof(Slot))) != 0) {
+			close(fd);
+			return;
+		}
+		st.st_size = (off_t)(sizeof(Header) + SLOT_COUNT * sizeof(Slot));
+	}
+
+	if (st.st_size >= (off_t)sizeof(Header)) {
+		void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) {
+			map = p;
+			map_size = (size_t)st.st_size;
+			const Header* header = (const Header*)p;
+			if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 && header->slot_count > 0 &&
+				sizeof(Header) + header->slot_count * sizeof(Slot) == map_size) {
+				slot_count = header->slot_count;
+				slots = (Slot*)((char*)p + sizeof(Header));
+			}
+		}
+	}
+	close(fd);
+#else
+	(void)path;
+#endif
+}
+
+DiskCache::~DiskCache()
+{
+#ifdef INPUT_MMAP
+	if (map != nullptr) {
+		munmap(map, map_size);
+	}
+#endif
+}
+
+bool DiskCache::find(const CacheKey& key, LineResult& result)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	for (uint64_t i = 0; i < MAX_PROBES; i++) {
+		const Slot& slot = slots[(key.lo + i) % slot_count];
+		if (slot.status == 0) {
+			return false;
+		}
+		if (slot.hi == key.hi && slot.lo == key.lo) {
+			result = LineResult{ (LineStatus)slot.status, int_value((int32_t)slot.value) };
+			if (slot.is_float) {
+				std::memcpy(&result.value.f, &slot.value, sizeof(double));
+				result.value.is_float = true;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+void DiskCache::put(const CacheKey& key, const LineResult& result)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	Slot* slot = nullptr;
+	for (uint64_t i = 0; i < MAX_PROBES; i++) {
+		slot = &slots[(key.lo + i) % slot_count];
+		if (slot->status == 0 || (slot->hi == key.hi && slot->lo == key.lo)) {
+			break;
+		}
+	}
+	uint64_t value = (uint32_t)result.value.i;
+	if (result.value.is_float) {
+		std::memcpy(&value, &result.value.f, sizeof(double));
+	}
+	*slot = Slot{ key.hi, key.lo, value, (uint32_t)result.status, result.value.is_float };
+}
+
+void Stats::add(const Stats& other)
+{
+	lines += other.lines;
+	bytes += other.bytes;
+	for (int i = 0; i < TOKEN_TYPE_COUNT; i++) {
+		tokens[i] += other.tokens[i];
+		token_bytes[i] += other.token_bytes[i];
+	}
+	parse.add(other.parse);
+	allocations += other.allocations;
+	allocation_bytes += other.allocation_bytes;
+	for (int i = 0; i < (int)Phase::Count; i++) {
+		nanoseconds[i] += other.nanoseconds[i];
+	}
+	for (int i = 0; i < (int)LineError::Count; i++) {
+		rejected[i] += other.rejected[i];
+	}
+}
+
+std::atomic<bool> stats_requested(false);
+
+void print_stats(const Stats& stats, std::FILE* f)
+{
+	static const char* const phase_names[] = { "lex", "parse", "eval" };
+	std::string json = "{\"lines\":" + std::to_string(stats.lines) + ",\"bytes\":" + std::to_string(stats.bytes) + ",\"tokens\":{";
+	for (int i = 0; i < TOKEN_TYPE_COUNT; i++) {
+		json += (i > 0 ? ",\"" : "\"") + toString((TokenType)i) + "\":{\"count\":" + std::to_string(stats.tokens[i]) +
+			",\"bytes\":" + std::to_string(stats.token_bytes[i]) + "}";
+	}
+	json += "},\"nodes\":{";
+	for (int i = 0; i < (int)NodeType::NONE; i++) {
+		json += (i > 0 ? ",\"" : "\"") + toString((NodeType)i) + "\":" + std::to_string(stats.parse.nodes[i]);
+	}
+	json += "},\"backtracks\":" + std::to_string(stats.parse.backtracks) + ",\"rewinds\":" + std::to_string(stats.parse.rewinds) +
+		",\"restarts\":" + std::to_string(stats.parse.restarts) + ",\"max_depth\":" + std::to_string(stats.parse.max_depth) +
+		",\"allocations\":" + std::to_string(stats.allocations) + ",\"allocation_bytes\":" + std::to_string(stats.allocation_bytes) +
+		",\"seconds\":{";
+	for (int i = 0; i < (int)Phase::Count; i++) {
+		char seconds[32];
+		std::snprintf(seconds, sizeof(seconds), "%.6f", stats.nanoseconds[i] / 1e9);
+		json += (i > 0 ? ",\"" : "\"") + std::string(phase_names[i]) + "\":" + seconds;
+	}
+	json += "},\"rejected\":{";
+	for (int i = 1; i < (int)LineError::Count; i++) {
+		json += (i > 1 ? ",\"" : "\"") + toString((LineError)i) + "\":" + std::to_string(stats.rejected[i]);
+	}
+	json += "}}\n";
+	std::fwrite(json.data(), 1, json.size(), f);
+	std::fflush(f);
+}
+
+void LineEvaluator::print_token(const Token& tk, std::string_view text)
+{
+	stats.tokens[(int)tk.type]++;
+	stats.token_bytes[(int)tk.type] += tk.length;
+	if (options.format == OutputFormat::Binary) {
+		append_binary_token(out, tk, text);
+		return;
+	}
+	const std::string_view prefix = token_line_prefix[(int)tk.type];
+	out.append(prefix.data(), prefix.size());
+	out.append(text.data(), text.size());
+	out += '\n';
+}
+
+void LineEvaluator::print_result(const LineResult& result)
+{
+	if (options.format == OutputFormat::Binary) {
+		append_binary_result(out, result);
+	}
+	else {
+		append_result(out, result);
+	}
+}
+
+void LineEvaluator::end_line()
+{
+	//  hw2
+	if (!tokens.empty() && columns != nullptr) {
+		const uint64_t t0 = now();
+		parser.reset();
+		const AstNode* root = parser.get_abstract_syntax_tree();
+		const uint64_t t1 = now();
+		print_columns(root);
+		stats.nanoseconds[(int)Phase::Parse] += t1 - t0;
+		stats.nanoseconds[(int)Phase::Eval] += now() - t1;
+	}
+	else if (!tokens.empty()) {
+		print_result(evaluate_tokens());
+	}
+	tokens.clear();
+	line_done();
+}
+
+LineResult LineEvaluator::evaluate_line(std::string_view line)
+{
+	static const char newline = '\n';
+
+	tokens.clear();
+	dfa.reset();
+	{
+		TRACE_SCOPE("lex");
+		dfa.lex(line.data(), line.size(), tokens);
+		dfa.lex(&newline, 1, tokens);
+	}
+	const LineResult result = tokens.empty() ? LineResult{ LineStatus::Invalid, Value() } : evaluate_tokens();
+	tokens.clear();
+	return result;
+}
+
+LineResult LineEvaluator::evaluate_tokens()
+{
+	// Lines that cannot be an expression are told apart from the token types, without the Parser or the caches
+	const TokenCheck check = check_tokens(tokens.data(), tokens.size(), options.parser);
+	if (check.error != LineError::None) {
+		stats.rejected[(int)check.error]++;
+		return LineResult{ LineStatus::Invalid, Value() };
+	}
+
+	const bool caching = options.cache > 0 || disk_cache != nullptr;
+	CacheKey key = {};
+	LineResult result;
+	if (caching) {
+		key = cache_key(tokens, dfa.names, (uint64_t)options.parser | (uint64_t)options.eval << 8);
+	}
+	if (!caching || !find_cached(key, result)) {
+		const uint64_t t0 = now();
+		parser.reset();
+		const AstNode* root = parser.get_abstract_syntax_tree();
+		const uint64_t t1 = now();
+		result = evaluate(root);
+		stats.nanoseconds[(int)Phase::Parse] += t1 - t0;
+		stats.nanoseconds[(int)Phase::Eval] += now() - t1;
+		if (caching) {
+			cache_stats.misses++;
+			cache.put(key, result);
+			if (disk_cache != nullptr) {
+				disk_cache->put(key, result);
+			}
+		}
+	}
+	return result;
+}
+
+bool LineEvaluator::find_cached(const CacheKey& key, LineResult& result)
+{
+	TRACE_SCOPE("cache");
+	if (cache.find(key, result)) {
+		cache_stats.hits++;
+		return true;
+	}
+	if (disk_cache != nullptr && disk_cache->find(key, result)) {
+		cache_stats.disk_hits++;
+		cache.put(key, result);
+		return true;
+	}
+	return false;
+}
+
+LineResult LineEvaluator::evaluate(const AstNode* root)
+{
+	TRACE_SCOPE("eval");
+	if (root == nullptr) {
+		return LineResult{ LineStatus::Invalid, Value() };
+	}
+	if (parser.literal_out_of_range) {
+		return LineResult{ LineStatus::OutOfRange, Value() };
+	}
+	if (parser.has_variable) {
+		return LineResult{ LineStatus::Unbound, Value() };
+	}
+
+	Value value = root->value;
+	bool div_by_zero = parser.div_by_zero;
+	if (options.eval == EvalMode::Flat) {
+		flatten(root, flat);
+		div_by_zero = false;
+		value = flat.evaluate(flat_stack, div_by_zero);
+	}
+	else if (options.eval == EvalMode::Jit && jit.compile(root)) {
+		div_by_zero = false;
+		value = int_value(jit.run(div_by_zero));
+	}
+	else if (options.eval == EvalMode::Vm || options.eval == EvalMode::Jit) {
+		compile(root, program);
+		div_by_zero = false;
+		value = program.run(program_stack, div_by_zero);
+	}
+	else if (options.eval == EvalMode::Dag) {
+		const ExprDag::Node& node = dag.add(root);
+		div_by_zero = node.div_by_zero;
+		value = node.value;
+	}
+
+	if (div_by_zero) {
+		return LineResult{ LineStatus::DivByZero, Value() };
+	}
+	return LineResult{ LineStatus::Value, value };
+}
+
+// The shortest text that reads back as v, with a '.0' if it would look like an int, like '2.0', '0.1', '1e+300'
+static void append_float(std::string& out, double v)
+{
+	if (std::isnan(v)) {
+		out += "nan";
+		return;
+	}
+	char buf[32];
+	char* end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+	out.append(buf, end);
+	if (std::isfinite(v) && std::find_if(buf, end, [](char c) { return c == '.' || c == 'e'; }) == end) {
+		out += ".0";
+	}
+}
+
+void append_result(std::string& out, const LineResult& result)
+{
+	switch (result.status) {
+	case LineStatus::Value:
+		if (result.value.is_float) {
+			append_float(out, result.value.f);
+		}
+		else {
+			char buf[16];
+			out.append(buf, std::to_chars(buf, buf + sizeof(buf), result.value.i).ptr);
+		}
+		out += '\n';
+		break;
+	case LineStatus::Invalid:
+		out += "error: invalid expression\n";
+		break;
+	case LineStatus::DivByZero:
+		out += "error: division by zero\n";
+		break;
+	case LineStatus::Unbound:
+		out += "error: unbound variable\n";
+		break;
+	case LineStatus::OutOfRange:
+		out += "error: literal out of range\n";
+		break;
+	}
+}
+
+void append_binary_result(std::string& out, const LineResult& result)
+{
+	if (result.status != LineStatus::Value) {
+		out += (char)((uint8_t)BinaryTag::IntValue + (uint8_t)result.status);
+	}
+	else if (result.value.is_float) {
+		out += (char)BinaryTag::FloatValue;
+		append_binary_float(out, result.value.f);
+	}
+	else {
+		out += (char)BinaryTag::IntValue;
+		append_binary_int(out, result.value.i);
+	}
+}
+
+// One result per row of the columns, or one error if the expression cannot be evaluated at all
+void LineEvaluator::print_columns(const AstNode* root)
+{
+	TRACE_SCOPE("eval");
+	if (root == nullptr) {
+		print_result(LineResult{ LineStatus::Invalid, Value() });
+		return;
+	}
+	if (parser.literal_out_of_range) {
+		print_result(LineResult{ LineStatus::OutOfRange, Value() });
+		return;
+	}
+	flatten(root, flat);
+	if (!column_evaluator.compile(flat, *columns, dfa.names)) {
+		print_result(LineResult{ LineStatus::Unbound, Value() });
+		return;
+	}
+	if (column_evaluator.is_float) {
+		column_evaluator.run_float(*columns, column_float_values, column_div_by_zero);
+		for (size_t row = 0; row < column_float_values.size(); row++) {
+			print_result(LineResult{ column_div_by_zero[row] ? LineStatus::DivByZero : LineStatus::Value, float_value(column_float_values[row]) });
+		}
+		return;
+	}
+	column_evaluator.run(*columns, column_values, column_div_by_zero);
+	for (size_t row = 0; row < column_values.size(); row++) {
+		print_result(LineResult{ column_div_by_zero[row] ? LineStatus::DivByZero : LineStatus::Value, int_value(column_values[row]) });
+	}
+}
+
+void LineEvaluator::line_done()
+{
+	stats.lines++;
+	if (options.stats) {
+		// The time of the line that was not parsing or evaluating was lexing
+		const uint64_t t = now();
+		const uint64_t timed = stats.nanoseconds[(int)Phase::Parse] + stats.nanoseconds[(int)Phase::Eval];
+		stats.nanoseconds[(int)Phase::Lex] += (t - time_mark) - (timed - timed_mark);
+		time_mark = t;
+		timed_mark = timed;
+	}
+	if (writer != nullptr && out.size() >= FLUSH_SIZE) {
+		flush();
+	}
+	// With a writer this is the only LineEvaluator, see run_parallel for the others
+	if (writer != nullptr && stats_requested.load(std::memory_order_relaxed) && stats_requested.exchange(false)) {
+		settle_stats();
+		print_stats(stats, stderr);
+	}
+}
+
+void LineEvaluator::settle_stats()
+{
+	stats.parse.add(parser.stats);
+	parser.stats = ParseStats();
+	stats.allocations += allocation_count - allocation_mark;
+	stats.allocation_bytes += allocation_bytes - allocation_bytes_mark;
+	allocation_mark = allocation_count;
+	allocation_bytes_mark = allocation_bytes;
+}
+
+void LineEvaluator::take_stats(Stats& total)
+{
+	total.add(stats);
+	stats = Stats();
+}
+
+void LineEvaluator::flush()
+{
+	TRACE_SCOPE("write");
+	writer->write(out);
+	out.clear();
+}
+
+}  // namespace expr
@@ -0,0 +1,352 @@
+#ifndef EXPR_LINE_EVALUATOR_H
+#define EXPR_LINE_EVALUATOR_H
+
+#include<atomic>
+#include<chrono>
+#include<cstdint>
+#include<cstdio>
+#include<list>
+#include<mutex>
+#include<string>
+#include<string_view>
+#include<unordered_map>
+#include<vector>
+
+#include "eval.h"
+#include "validate.h"
+#include "writer.h"
+
+namespace expr {
+
+// What is printed after the tokens of a line
+enum class LineStatus : uint8_t {
+	Value = 1,  // the value
+	Invalid,    // error: invalid expression
+	DivByZero,  // error: division by zero
+	Unbound,    // error: unbound variable
+	OutOfRange  // error: literal out of range
+};
+
+struct LineResult {
+	LineStatus status;
+	Value value;
+};
+
+// A line is known by a 128 bit hash of its tokens, types and decoded values only: lines that differ
+// in spaces or in the spelling of a literal, like '0x10' and '16', have the same key
+struct CacheKey {
+	uint64_t hi;
+	uint64_t lo;
+	bool operator==(const CacheKey& other) const { return hi == other.hi && lo == other.lo; }
+};
+
+struct CacheKeyHash {
+	size_t operator()(const CacheKey& k) const { return (size_t)(k.hi ^ k.lo); }
+};
+
+/**
+  *  Func: Hash the tokens of a line.
+  *  @param[in] names: The names of the IDENT tokens, the whole name of each goes into the key.
+  *  @param[in] seed: Tells apart the results of parsers and evaluators that do not agree on every line.
+  */
+CacheKey cache_key(const std::vector<Token>& tokens, const NameTable& names, uint64_t seed);
+
+// The results of the most recently used lines, at most capacity of them
+struct ResultCache {
+	explicit ResultCache(size_t capacity) : capacity(capacity), order(), index() {}
+
+	/**
+	  *  Func: Look up a line, a line that is found becomes the most recently used.
+	  *  @return: False if the line is not cached.
+	  */
+	bool find(const CacheKey& key, LineResult& result);
+
+	/**
+	  *  Func: Add a line that is not cached yet, the least recently used one goes if the cache is full.
+	  */
+	void put(const CacheKey& key, const LineResult& result);
+
+private:
+	struct Entry {
+		CacheKey key;
+		LineResult result;
+	};
+
+	size_t capacity;
+	std::list<Entry> order;  // the most recently used first
+	std::unordered_map<CacheKey, std::list<Entry>::iterator, CacheKeyHash> index;
+};
+
+// Results kept in a file between runs: a fixed size hash table mapped into memory and shared by all threads.
+// A line goes to one of MAX_PROBES slots from its hash, and replaces the last of them if they are all taken.
+struct DiskCache {
+	static constexpr uint64_t SLOT_COUNT = 1 << 20;  // of a new file
+	static constexpr uint64_t MAX_PROBES = 8;
+
+	explicit DiskCache(const char* path);
+	~DiskCache();
+
+	DiskCache(const DiskCache&) = delete;
+	DiskCache& operator=(const DiskCache&) = delete;
+
+	/**
+	  *  Func: Check if the file was opened or created successfully.
+	  */
+	bool ok() const { return slots != nullptr; }
+
+	bool find(const CacheKey& key, LineResult& result);
+	void put(const CacheKey& key, const LineResult& result);
+
+private:
+	static constexpr char MAGIC[8] = { 'E', 'X', 'P', 'R', 'C', 'C', 'H', '3' };
+
+	struct Header {
+		char magic[8];
+		uint64_t slot_count;
+	};
+
+	struct Slot {
+		uint64_t hi;
+		uint64_t lo;
+		uint64_t value;  // the int, or the bits of the double
+		uint32_t status;  // a LineStatus, 0 if the slot is free
+		uint32_t is_float;
+	};
+
+	std::mutex lock;
+	void* map;
+	size_t map_size;
+	Slot* slots;
+	uint64_t slot_count;
+};
+
+// How the value of a line is computed
+enum class EvalMode {
+	Tree,  // the value the Parser computes while it builds the tree
+	Flat,  // evaluate a FlatAst made from the tree
+	Vm,    // run a Program compiled from the tree
+	Jit,   // run native code compiled from the tree, or a Program where there is no JIT
+	Dag    // add the tree to an ExprDag, shared subexpressions are evaluated once
+};
+
+struct Options {
+	const char* path = nullptr;  // read stdin if nullptr
+	unsigned jobs = 1;
+	EvalMode eval = EvalMode::Tree;
+	ParserKind parser = ParserKind::RecursiveDescent;
+	bool fused = false;  // pull the tokens into parse_Stack as they are lexed, there is no token vector then
+	size_t cache = 0;  // lines kept in the ResultCache of each thread, 0 for none
+	const char* cache_file = nullptr;  // the file of the DiskCache, nullptr for none
+	const char* columns = nullptr;  // the file of a ColumnTable, every line is then evaluated for each row of it
+	bool stats = false;  // print the Stats as JSON to stderr at exit and on SIGUSR1
+	const char* trace = "trace.json";  // where the Chrome trace goes at exit if built with TRACE
+	bool bench = false;  // run the benchmark instead of reading input
+	uint64_t bench_seed = 1;  // seed of the benchmark workloads
+	const char* serve = nullptr;  // the Unix socket to serve on instead of reading input, nullptr for none
+	const char* connect = nullptr;  // the Unix socket of a server to send the input to, nullptr for none
+	OutputFormat format = OutputFormat::Text;  // of the tokens and the results, the server always speaks text
+};
+
+// How often the caches spared parsing a line
+struct CacheStats {
+	uint64_t hits = 0;  // found in the ResultCache
+	uint64_t disk_hits = 0;  // found in the DiskCache
+	uint64_t misses = 0;  // parsed and evaluated
+};
+
+constexpr int TOKEN_TYPE_COUNT = (int)TokenType::FLOATLTR + 1;
+
+// Phases of LineEvaluator, for the time spent in each
+enum class Phase {
+	Lex,    // lexing and printing the tokens, or all but parse and eval
+	Parse,  // with --fused the lexing is done while parsing and counts here
+	Eval,
+	Count
+};
+
+// What the LineEvaluators did, for --stats. The counts are always kept, the times only with --stats.
+struct Stats {
+	uint64_t lines = 0;
+	uint64_t bytes = 0;  // of input
+	uint64_t tokens[TOKEN_TYPE_COUNT] = {};
+	uint64_t token_bytes[TOKEN_TYPE_COUNT] = {};  // text of the tokens, without spaces
+	ParseStats parse;
+	uint64_t allocations = 0;  // operator new calls
+	uint64_t allocation_bytes = 0;
+	uint64_t nanoseconds[(int)Phase::Count] = {};
+	uint64_t rejected[(int)LineError::Count] = {};  // lines check_tokens found invalid, they were not parsed
+
+	void add(const Stats& other);
+};
+
+/**
+  *  Func: Print stats as one line of JSON.
+  */
+void print_stats(const Stats& stats, std::FILE* f);
+
+/**
+  *  Func: Append a result the way it is printed after the tokens of its line, with a '\n'.
+  */
+void append_result(std::string& out, const LineResult& result);
+
+/**
+  *  Func: Append the record of a result in the binary format of writer.h.
+  */
+void append_binary_result(std::string& out, const LineResult& result);
+
+// Set by SIGUSR1: whoever prints the output prints the Stats so far at the next line
+extern std::atomic<bool> stats_requested;
+
+// Everything needed to lex, parse and print line after line, one per thread
+struct LineEvaluator {
+	static constexpr size_t FLUSH_SIZE = OutputWriter::CHUNK_SIZE;
+
+	DFA dfa;
+	std::vector<Token> tokens;  // the tokens of the current line, unless options.fused
+	Parser parser;  // parses tokens, its arena is reused from line to line
+	FlatAst flat;
+	std::vector<Value> flat_stack;  // operands of flat.evaluate
+	Program program;
+	Program::Stack program_stack;  // operands of program.run
+	JitCode jit;
+	ExprDag dag;  // shared by all the lines this LineEvaluator evaluates
+	ResultCache cache;
+	DiskCache* disk_cache;  // shared by all threads, nullptr if not used
+	CacheStats cache_stats;
+	const ColumnTable* columns;  // the variables, nullptr if there are none
+	ColumnEvaluator column_evaluator;
+	std::vector<int> column_values;
+	std::vector<double> column_float_values;
+	std::vector<uint8_t> column_div_by_zero;
+	const Options& options;
+	std::string out;  // Output of the lines evaluated so far
+	OutputWriter* writer;  // out is written here once it grows past FLUSH_SIZE, or kept if nullptr
+	Stats stats;  // parser.stats and the allocations are added by settle_stats
+	uint64_t allocation_mark;  // allocation_count when the allocations were last added to stats
+	uint64_t allocation_bytes_mark;
+	uint64_t time_mark;  // now() at the end of the last line
+	uint64_t timed_mark;  // the parse and eval nanoseconds of stats at time_mark
+
+	explicit LineEvaluator(const Options& options, OutputWriter* writer = nullptr, DiskCache* disk_cache = nullptr, const ColumnTable* columns = nullptr)
+		: dfa(), tokens(), parser(tokens), flat(), flat_stack(), program(), program_stack(), jit(), dag(), cache(options.cache), disk_cache(disk_cache),
+		  cache_stats(), columns(columns), column_evaluator(), column_values(), column_float_values(), column_div_by_zero(), options(options), out(), writer(writer), stats(),
+		  allocation_mark(0), allocation_bytes_mark(0), time_mark(0), timed_mark(0)
+	{
+		parser.kind = options.parser;
+	}
+
+	/**
+	  *  Func: Evaluate every line of in, the tokens and the value of each line go to out.
+	  *  @param[in] in: The input, anything with a next_chunk like InputReader.
+	  */
+	template <typename Source>
+	void run(Source& in);
+
+	/**
+	  *  Func: Evaluate one line without printing anything, the caches are used as by run.
+	  *  @param[in] line: The expression, a '\n' in it separates tokens like a space.
+	  *  @return: Invalid if the line has no tokens.
+	  */
+	LineResult evaluate_line(std::string_view line);
+
+	/**
+	  *  Func: Hand out to writer.
+	  */
+	void flush();
+
+	/**
+	  *  Func: Add the Stats of the runs since the last call to total, then start counting from zero again.
+	  */
+	void take_stats(Stats& total);
+
+private:
+	// Input that counts the bytes it hands out into stats
+	template <typename Source>
+	struct CountedInput {
+		Source& in;
+		uint64_t& bytes;
+
+		bool next_chunk(const char*& data, size_t& size) {
+			if (!in.next_chunk(data, size)) {
+				return false;
+			}
+			bytes += size;
+			return true;
+		}
+	};
+
+	// Steady clock in nanoseconds with --stats, 0 without, reading the clock costs about as much as a short line
+	uint64_t now() const {
+		return options.stats ? (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() : 0;
+	}
+
+	template <typename Source>
+	void run_fused(Source& in);
+
+	void print_token(const Token& tk, std::string_view text);
+	void print_result(const LineResult& result);
+	void end_line();
+	LineResult evaluate_tokens();
+	bool find_cached(const CacheKey& key, LineResult& result);
+	LineResult evaluate(const AstNode* root);
+	void print_columns(const AstNode* root);
+	void line_done();
+	void settle_stats();
+};
+
+template <typename Source>
+void LineEvaluator::run(Source& in)
+{
+	allocation_mark = allocation_count;
+	allocation_bytes_mark = allocation_bytes;
+	time_mark = now();
+	timed_mark = stats.nanoseconds[(int)Phase::Parse] + stats.nanoseconds[(int)Phase::Eval];
+
+	CountedInput<Source> counted{ in, stats.bytes };
+	if (options.fused) {
+		run_fused(counted);
+	}
+	else {
+		lex_lines(counted, dfa,
+			[this](const Token& tk, std::string_view text) {
+				print_token(tk, text);
+				tokens.push_back(tk);
+			},
+			[this]() {
+				end_line();
+			});
+	}
+	settle_stats();
+}
+
+template <typename Source>
+void LineEvaluator::run_fused(Source& in)
+{
+	auto on_token = [this](const Token& tk, std::string_view text) {
+		print_token(tk, text);
+	};
+	TokenPuller<Source, decltype(on_token)> puller(in, dfa, on_token);
+	while (puller.next_line()) {
+		if (puller.peek() != nullptr) {
+			const uint64_t t0 = now();
+			parser.reset();
+			AstNode* root = parser.get_abstract_syntax_tree(puller);
+			// The tokens after the expression are printed all the same
+			puller.skip_line();
+			const uint64_t t1 = now();
+			if (columns != nullptr) {
+				print_columns(root);
+			}
+			else {
+				print_result(evaluate(root));
+			}
+			stats.nanoseconds[(int)Phase::Parse] += t1 - t0;
+			stats.nanoseconds[(int)Phase::Eval] += now() - t1;
+		}
+		line_done();
+	}
+}
+
+}  // namespace expr
+
+#endif
@@ -0,0 +1,104 @@
+#include "parallel.h"
+
+namespace expr {
+
+ThreadPool::ThreadPool(unsigned n) : queues(), threads(), sleep_mutex(), wake(), queued(0), next_queue(0), stop(false)
+{
+	for (unsigned i = 0; i < n; i++) {
+		queues.emplace_back(new Queue());
+	}
+	for (unsigned i = 0; i < n; i++) {
+		threads.emplace_back(&ThreadPool::work, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stop = true;
+	}
+	wake.notify_all();
+	for (auto& t : threads) {
+		t.join();
+	}
+}
+
+void ThreadPool::submit(Task task)
+{
+	Queue& q = *queues[next_queue];
+	next_queue = (next_queue + 1) % queues.size();
+	{
+		std::lock_guard<std::mutex> lock(q.mutex);
+		q.tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		queued++;
+	}
+	wake.notify_one();
+}
+
+bool ThreadPool::pop(unsigned self, Task& task)
+{
+	Queue& q = *queues[self];
+	std::lock_guard<std::mutex> lock(q.mutex);
+	if (q.tasks.empty()) {
+		return false;
+	}
+	task = std::move(q.tasks.back());
+	q.tasks.pop_back();
+	queued--;
+	return true;
+}
+
+bool ThreadPool::steal(unsigned self, Task& task)
+{
+	for (size_t i = 1; i < queues.size(); i++) {
+		Queue& q = *queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (!q.tasks.empty()) {
+			task = std::move(q.tasks.front());
+			q.tasks.pop_front();
+			queued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::work(unsigned self)
+{
+	Task task;
+	for (;;) {
+		if (pop(self, task) || steal(self, task)) {
+			task(self);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		wake.wait(lock, [this]() { return stop || queued > 0; });
+		if (stop && queued == 0) {
+			return;
+		}
+	}
+}
+
+void ReorderBuffer::put(size_t seq, std::string text)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ready[seq] = std::move(text);
+	}
+	ready_cv.notify_all();
+}
+
+std::string ReorderBuffer::take(size_t seq)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	ready_cv.wait(lock, [&]() { return ready.count(seq) != 0; });
+	std::string text = std::move(ready[seq]);
+	ready.erase(seq);
+	return text;
+}
+
+}  // namespace expr
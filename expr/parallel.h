@@ -0,0 +1,127 @@
+#ifndef EXPR_PARALLEL_H
+#define EXPR_PARALLEL_H
+
+#include<atomic>
+#include<condition_variable>
+#include<cstddef>
+#include<deque>
+#include<functional>
+#include<map>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<thread>
+#include<vector>
+
+#include "lexer.h"
+
+namespace expr {
+
+// A fixed set of threads, each with its own deque of tasks. A thread runs its own newest task
+// first and steals the oldest task of another thread when its deque runs dry.
+struct ThreadPool {
+	typedef std::function<void(unsigned worker)> Task;
+
+	explicit ThreadPool(unsigned n);
+	~ThreadPool();  // Runs the remaining tasks, then joins
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/**
+	  *  Func: Queue a task, it is called with the index of the worker that runs it.
+	  */
+	void submit(Task task);
+
+	unsigned size() const { return (unsigned)threads.size(); }
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void work(unsigned self);
+	bool pop(unsigned self, Task& task);
+	bool steal(unsigned self, Task& task);
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+	std::atomic<size_t> queued;  // Tasks in all the deques
+	unsigned next_queue;
+	bool stop;
+};
+
+// Output of blocks that finish out of order waits here until every earlier block is written
+struct ReorderBuffer {
+	void put(size_t seq, std::string text);
+
+	/**
+	  *  Func: Wait for the output of block seq and take it out of the buffer.
+	  */
+	std::string take(size_t seq);
+
+private:
+	std::mutex mutex;
+	std::condition_variable ready_cv;
+	std::map<size_t, std::string> ready;
+};
+
+// A run of whole lines, either pointing into the mapped input or owning a copy of piped input
+struct InputBlock {
+	std::string owned;
+	const char* data;
+	size_t size;
+
+	const char* begin() const { return owned.empty() ? data : owned.data(); }
+	size_t length() const { return owned.empty() ? size : owned.size(); }
+};
+
+/**
+  *  Func: Cut the input into blocks of whole lines, about block_size bytes each.
+  *  @param[in] on_block: Called with every InputBlock, in input order.
+  */
+template <typename OnBlock>
+void split_blocks(InputReader& in, size_t block_size, OnBlock&& on_block)
+{
+	const char* data;
+	size_t size;
+	std::string carry;  // Piped lines that do not make a full block yet
+
+	while (in.next_chunk(data, size)) {
+		if (in.mapped()) {
+			const char* p = data;
+			const char* end = data + size;
+			while (p != end) {
+				const char* cut = end;
+				if ((size_t)(end - p) > block_size) {
+					const char* nl = (const char*)std::memchr(p + block_size, '\n', end - p - block_size);
+					cut = nl ? nl + 1 : end;
+				}
+				on_block(InputBlock{ std::string(), p, (size_t)(cut - p) });
+				p = cut;
+			}
+			continue;
+		}
+
+		carry.append(data, size);
+		if (carry.size() >= block_size) {
+			size_t nl = carry.rfind('\n');
+			if (nl != std::string::npos) {
+				std::string rest = carry.substr(nl + 1);
+				carry.resize(nl + 1);
+				on_block(InputBlock{ std::move(carry), nullptr, 0 });
+				carry = std::move(rest);
+			}
+		}
+	}
+	if (!carry.empty()) {
+		on_block(InputBlock{ std::move(carry), nullptr, 0 });
+	}
+}
+
+}  // namespace expr
+
+#endif
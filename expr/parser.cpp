@@ -0,0 +1,664 @@
+#include<cstdlib>
+#include<new>
+
+#include "parser.h"
+
+namespace expr {
+
+std::string toString(NodeType nt) {
+	switch (nt) {
+	case  NodeType::TERMINAL:  return  "Terminal";
+	case  NodeType::EXP:  return  "Exp";
+	case  NodeType::NUMBER:  return  "Number";
+	case  NodeType::PRIMARYEXP:  return  "PrimaryExp";
+	case  NodeType::UNARYEXP:  return  "UnaryExp";
+	case  NodeType::UNARYOP:  return  "UnaryOp";
+	case  NodeType::MULEXP:  return  "MulExp";
+	case  NodeType::ADDEXP:  return  "AddExp";
+	case  NodeType::LVAL:  return  "LVal";
+	case  NodeType::NONE:  return  "NONE";
+	default:
+		assert(0 && "invalid  node  type");
+		break;
+	}
+	return  "";
+}
+
+Arena::~Arena()
+{
+	for (Block& b : blocks) {
+		::operator delete(b.data);
+	}
+}
+
+static inline char* align_up(char* p, size_t align)
+{
+	return (char*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+void* Arena::allocate(size_t size, size_t align)
+{
+	char* p = align_up(ptr, align);
+	if (ptr == nullptr || p + size > end) {
+		// Move on to the next block that is big enough, or add one
+		size_t next = ptr == nullptr ? cur : cur + 1;
+		while (next < blocks.size() && blocks[next].size < size + align) {
+			next++;
+		}
+		if (next == blocks.size()) {
+			size_t n = std::max(BLOCK_SIZE, size + align);
+			blocks.push_back(Block{ (char*)::operator new(n), n });
+		}
+		cur = next;
+		ptr = blocks[cur].data;
+		end = ptr + blocks[cur].size;
+		p = align_up(ptr, align);
+	}
+	used += (size_t)(p + size - ptr);
+	ptr = p + size;
+	return p;
+}
+
+void Arena::reset()
+{
+	cur = 0;
+	ptr = nullptr;
+	end = nullptr;
+	used = 0;
+}
+
+void ParseStats::add(const ParseStats& other)
+{
+	for (int i = 0; i <= (int)NodeType::NONE; i++) {
+		nodes[i] += other.nodes[i];
+	}
+	backtracks += other.backtracks;
+	rewinds += other.rewinds;
+	restarts += other.restarts;
+	max_depth = std::max(max_depth, other.max_depth);
+}
+
+bool Parser::parse_Exp(AstNode* root)
+{
+	TRACE_SCOPE("parse_Exp");
+	AstNode* child = new_node(NodeType::ADDEXP, root);
+	if (parse_AddExp(child)) {
+		root->children.push_back(child);
+		root->value = child->value;
+		return true;
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+}
+
+bool Parser::parse_AddExp(AstNode* root)
+{
+	TRACE_SCOPE("parse_AddExp");
+	const FlagMark mark = mark_flags();
+	AstNode* child_1 = new_node(NodeType::MULEXP, root);
+	if (parse_MulExp(child_1)) {
+		root->children.push_back(child_1);
+		root->value = child_1->value;
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+
+	//  { } 
+	if (index >= token_stream.size()) {
+		return true;
+	}
+
+	int count = 0;
+	while (token_stream[index].type == TokenType::PLUS || token_stream[index].type == TokenType::MINU) {
+		int record = index;  // ¼λ
+
+		AstNode* child_2 = new_node(NodeType::TERMINAL, root);
+		child_2->token = token_stream[index].type;
+		root->children.push_back(child_2);
+		index++;
+		count++;
+
+		AstNode* child_3 = new_node(NodeType::MULEXP, root);
+		if (parse_MulExp(child_3)) {
+			root->children.push_back(child_3);
+			root->value = apply_binary(token_stream[record].type, root->value, child_3->value, div_by_zero);
+		}
+		else {
+			root->children.clear();
+			restore_flags(mark);
+			stats.rewinds += count;
+			while (count--) {
+				index--;
+			}
+			return false;
+		}
+
+		if (index >= token_stream.size()) {
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool Parser::parse_MulExp(AstNode* root)
+{
+	TRACE_SCOPE("parse_MulExp");
+	const FlagMark mark = mark_flags();
+	AstNode* child_1 = new_node(NodeType::UNARYEXP, root);
+	if (parse_UnaryExp(child_1)) {
+		root->children.push_back(child_1);
+		root->value = child_1->value;
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+
+	//  { } 
+	if (index >= token_stream.size()) {
+		return true;
+	}
+
+	int count = 0;
+	while (token_stream[index].type == TokenType::MULT || token_stream[index].type == TokenType::DIV) {
+		int record = index;  // ¼λ
+
+		AstNode* child_2 = new_node(NodeType::TERMINAL, root);
+		child_2->token = token_stream[index].type;
+		root->children.push_back(child_2);
+		index++;
+		count++;
+
+		AstNode* child_3 = new_node(NodeType::UNARYEXP, root);
+		if (parse_UnaryExp(child_3)) {
+			root->children.push_back(child_3);
+			root->value = apply_binary(token_stream[record].type, root->value, child_3->value, div_by_zero);
+		}
+		else {
+			root->children.clear();
+			restore_flags(mark);
+			stats.rewinds += count;
+			while (count--) {
+				index--;
+			}
+			return false;
+		}
+
+		if (index >= token_stream.size()) {
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool Parser::parse_UnaryExp(AstNode* root)
+{
+	TRACE_SCOPE("parse_UnaryExp");
+	if (!enter_nested()) {
+		return false;
+	}
+	DepthGuard guard(depth);
+
+	AstNode* child_1 = new_node(NodeType::PRIMARYEXP, root);
+	if (parse_PrimaryExp(child_1)) {
+		root->children.push_back(child_1);
+		root->value = child_1->value;
+		return true;
+	}
+	stats.backtracks++;
+
+	int record = index;  // ¼ UnaryOp ķλ
+	AstNode* child_2 = new_node(NodeType::UNARYOP, root);
+	if (parse_UnaryOp(child_2)) {
+		root->children.push_back(child_2);
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+
+	AstNode* child_3 = new_node(NodeType::UNARYEXP, root);
+	if (parse_UnaryExp(child_3)) {
+		root->children.push_back(child_3);
+		root->value = apply_unary(token_stream[record].type, child_3->value);
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool Parser::parse_PrimaryExp(AstNode* root)
+{
+	TRACE_SCOPE("parse_PrimaryExp");
+	AstNode* child = new_node(NodeType::NUMBER, root);
+	if (parse_Number(child)) {
+		root->children.push_back(child);
+		root->value = child->value;
+		return true;
+	}
+	stats.backtracks++;
+
+	AstNode* lval = new_node(NodeType::LVAL, root);
+	if (parse_LVal(lval)) {
+		root->children.push_back(lval);
+		return true;
+	}
+	stats.backtracks++;
+
+	const FlagMark mark = mark_flags();
+	if (index < token_stream.size() && token_stream[index].type == TokenType::LPARENT) {
+		AstNode* child_1 = new_node(NodeType::TERMINAL, root);
+		child_1->token = TokenType::LPARENT;
+		root->children.push_back(child_1);
+		index++;
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+
+	AstNode* child_2 = new_node(NodeType::EXP, root);
+	if (parse_Exp(child_2)) {
+		root->children.push_back(child_2);
+		root->value = child_2->value;
+	}
+	else {
+		root->children.clear();
+		stats.rewinds++;
+		index--;
+		return false;
+	}
+
+	if (index < token_stream.size() && token_stream[index].type == TokenType::RPARENT) {
+		AstNode* child_3 = new_node(NodeType::TERMINAL, root);
+		child_3->token = TokenType::RPARENT;
+		root->children.push_back(child_3);
+		index++;
+	}
+	else {
+		root->children.clear();
+		root->value = Value();
+		restore_flags(mark);
+		stats.rewinds += 2;
+		index -= 2;
+		return false;
+	}
+
+	return true;
+}
+
+bool Parser::parse_UnaryOp(AstNode* root)
+{
+	TRACE_SCOPE("parse_UnaryOp");
+	if (index < token_stream.size() && (token_stream[index].type == TokenType::PLUS || token_stream[index].type == TokenType::MINU)) {
+		AstNode* child = new_node(NodeType::TERMINAL, root);
+		child->token = token_stream[index].type;
+		root->children.push_back(child);
+		index++;
+		return true;
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+}
+
+bool Parser::parse_Number(AstNode* root)
+{
+	TRACE_SCOPE("parse_Number");
+	if (index < token_stream.size() && (token_stream[index].type == TokenType::INTLTR || token_stream[index].type == TokenType::FLOATLTR)) {
+		AstNode* child = new_node(NodeType::TERMINAL, root);
+		child->token = token_stream[index].type;
+		child->value = literal_value(token_stream[index]);
+		literal_out_of_range |= token_stream[index].out_of_range;
+		root->children.push_back(child);
+		root->value = child->value;
+		index++;
+		return true;
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+}
+
+bool Parser::parse_LVal(AstNode* root)
+{
+	TRACE_SCOPE("parse_LVal");
+	if (index < token_stream.size() && token_stream[index].type == TokenType::IDENT) {
+		AstNode* child = new_node(NodeType::TERMINAL, root);
+		child->token = TokenType::IDENT;
+		root->children.push_back(child);
+		root->name = (uint32_t)token_stream[index].value;
+		has_variable = true;
+		index++;
+		return true;
+	}
+	else {
+		root->children.clear();
+		return false;
+	}
+}
+
+bool Parser::parse_Exp_iterative(AstNode* root)
+{
+	TRACE_SCOPE("parse_Exp_iterative");
+	rule_stack.clear();
+	rule_stack.push_back(RuleFrame{ Rule::Exp, 0, root, nullptr, 0, 0, FlagMark() });
+	bool result = false;  // of the last rule that returned
+
+	// The frame on top calls rule on child and goes on at step when it returns
+	auto call = [this](uint8_t step, Rule rule, AstNode* child) {
+		RuleFrame& f = rule_stack.back();
+		f.step = step;
+		f.child = child;
+		rule_stack.push_back(RuleFrame{ rule, 0, child, nullptr, 0, 0, FlagMark() });
+	};
+	auto ret = [this, &result](bool ok) {
+		if (rule_stack.back().rule == Rule::UnaryExp) {
+			depth--;
+		}
+		rule_stack.pop_back();
+		result = ok;
+	};
+
+	while (!rule_stack.empty()) {
+		RuleFrame& f = rule_stack.back();
+		switch (f.rule) {
+		case Rule::Exp:
+			if (f.step == 0) {
+				call(1, Rule::AddExp, new_node(NodeType::ADDEXP, f.root));
+				break;
+			}
+			if (result) {
+				f.root->children.push_back(f.child);
+				f.root->value = f.child->value;
+			}
+			else {
+				f.root->children.clear();
+			}
+			ret(result);
+			break;
+
+		// AddExp and MulExp only differ in their operators and operands
+		case Rule::AddExp:
+		case Rule::MulExp: {
+			const bool add = f.rule == Rule::AddExp;
+			const NodeType operand_type = add ? NodeType::MULEXP : NodeType::UNARYEXP;
+			const Rule operand_rule = add ? Rule::MulExp : Rule::UnaryExp;
+			if (f.step == 0) {
+				f.mark = mark_flags();
+				call(1, operand_rule, new_node(operand_type, f.root));
+				break;
+			}
+			if (f.step == 1) {
+				if (!result) {
+					f.root->children.clear();
+					ret(false);
+					break;
+				}
+				f.root->children.push_back(f.child);
+				f.root->value = f.child->value;
+			}
+			else if (result) {
+				f.root->children.push_back(f.child);
+				f.root->value = apply_binary(token_stream[f.record].type, f.root->value, f.child->value, div_by_zero);
+			}
+			else {
+				f.root->children.clear();
+				restore_flags(f.mark);
+				stats.rewinds += f.count;
+				index -= f.count;
+				ret(false);
+				break;
+			}
+
+			if (index < token_stream.size()) {
+				const TokenType op = token_stream[index].type;
+				if (add ? (op == TokenType::PLUS || op == TokenType::MINU) : (op == TokenType::MULT || op == TokenType::DIV)) {
+					f.record = index;
+					AstNode* terminal = new_node(NodeType::TERMINAL, f.root);
+					terminal->token = op;
+					f.root->children.push_back(terminal);
+					index++;
+					f.count++;
+					call(2, operand_rule, new_node(operand_type, f.root));
+					break;
+				}
+			}
+			ret(true);
+			break;
+		}
+
+		case Rule::UnaryExp:
+			if (f.step == 0) {
+				depth++;
+				stats.max_depth = std::max(stats.max_depth, depth);
+				call(1, Rule::PrimaryExp, new_node(NodeType::PRIMARYEXP, f.root));
+				break;
+			}
+			if (f.step == 1) {
+				if (result) {
+					f.root->children.push_back(f.child);
+					f.root->value = f.child->value;
+					ret(true);
+					break;
+				}
+				stats.backtracks++;
+				f.record = index;
+				AstNode* op = new_node(NodeType::UNARYOP, f.root);
+				if (!parse_UnaryOp(op)) {
+					f.root->children.clear();
+					ret(false);
+					break;
+				}
+				f.root->children.push_back(op);
+				call(2, Rule::UnaryExp, new_node(NodeType::UNARYEXP, f.root));
+				break;
+			}
+			if (result) {
+				f.root->children.push_back(f.child);
+				f.root->value = apply_unary(token_stream[f.record].type, f.child->value);
+			}
+			else {
+				f.root->children.clear();
+			}
+			ret(result);
+			break;
+
+		case Rule::PrimaryExp:
+			if (f.step == 0) {
+				AstNode* number = new_node(NodeType::NUMBER, f.root);
+				if (parse_Number(number)) {
+					f.root->children.push_back(number);
+					f.root->value = number->value;
+					ret(true);
+					break;
+				}
+				stats.backtracks++;
+				AstNode* lval = new_node(NodeType::LVAL, f.root);
+				if (parse_LVal(lval)) {
+					f.root->children.push_back(lval);
+					ret(true);
+					break;
+				}
+				stats.backtracks++;
+				f.mark = mark_flags();
+				if (index >= token_stream.size() || token_stream[index].type != TokenType::LPARENT) {
+					f.root->children.clear();
+					ret(false);
+					break;
+				}
+				AstNode* open = new_node(NodeType::TERMINAL, f.root);
+				open->token = TokenType::LPARENT;
+				f.root->children.push_back(open);
+				index++;
+				call(1, Rule::Exp, new_node(NodeType::EXP, f.root));
+				break;
+			}
+			if (!result) {
+				f.root->children.clear();
+				stats.rewinds++;
+				index--;
+				ret(false);
+				break;
+			}
+			f.root->children.push_back(f.child);
+			f.root->value = f.child->value;
+			if (index < token_stream.size() && token_stream[index].type == TokenType::RPARENT) {
+				AstNode* close = new_node(NodeType::TERMINAL, f.root);
+				close->token = TokenType::RPARENT;
+				f.root->children.push_back(close);
+				index++;
+				ret(true);
+				break;
+			}
+			f.root->children.clear();
+			f.root->value = Value();
+			restore_flags(f.mark);
+			stats.rewinds += 2;
+			index -= 2;
+			ret(false);
+			break;
+		}
+	}
+	return result;
+}
+
+AstNode* Parser::parse_Pratt(AstNode* parent, uint8_t min_bp)
+{
+	TRACE_SCOPE("parse_Pratt");
+	AstNode* lhs = parse_Prefix(parent);
+	if (lhs == nullptr) {
+		return nullptr;
+	}
+
+	while (index < token_stream.size()) {
+		TokenType op = token_stream[index].type;
+		const BindingPower& bp = infix_binding_power[(int)op];
+		if (bp.left == 0 || bp.left < min_bp) {
+			break;
+		}
+
+		// lhs  op  rhs, with the same children as an AddExp or MulExp of one operator
+		AstNode* node = new_node(bp.node, parent);
+		AstNode* terminal = new_node(NodeType::TERMINAL, node);
+		terminal->token = op;
+		index++;
+
+		AstNode* rhs = parse_Pratt(node, bp.right);
+		if (rhs == nullptr) {
+			return nullptr;
+		}
+		lhs->parent = node;
+		node->children.push_back(lhs);
+		node->children.push_back(terminal);
+		node->children.push_back(rhs);
+		node->value = apply_binary(op, lhs->value, rhs->value, div_by_zero);
+		lhs = node;
+	}
+	return lhs;
+}
+
+AstNode* Parser::parse_Prefix(AstNode* parent)
+{
+	TRACE_SCOPE("parse_Prefix");
+	if (index >= token_stream.size() || !enter_nested()) {
+		return nullptr;
+	}
+	DepthGuard guard(depth);
+
+	const Token& tk = token_stream[index];
+	switch (tk.type) {
+	case TokenType::INTLTR:
+	case TokenType::FLOATLTR: {
+		AstNode* node = new_node(NodeType::NUMBER, parent);
+		node->value = literal_value(tk);
+		literal_out_of_range |= tk.out_of_range;
+		index++;
+		return node;
+	}
+	case TokenType::IDENT: {
+		AstNode* node = new_node(NodeType::LVAL, parent);
+		node->name = (uint32_t)tk.value;
+		has_variable = true;
+		index++;
+		return node;
+	}
+	case TokenType::PLUS:
+	case TokenType::MINU: {
+		AstNode* node = new_node(NodeType::UNARYEXP, parent);
+		AstNode* op = new_node(NodeType::UNARYOP, node);
+		AstNode* terminal = new_node(NodeType::TERMINAL, op);
+		terminal->token = tk.type;
+		op->children.push_back(terminal);
+		index++;
+
+		AstNode* operand = parse_Pratt(node, PREFIX_BINDING_POWER);
+		if (operand == nullptr) {
+			return nullptr;
+		}
+		node->children.push_back(op);
+		node->children.push_back(operand);
+		node->value = apply_unary(terminal->token, operand->value);
+		return node;
+	}
+	case TokenType::LPARENT: {
+		index++;
+		AstNode* inner = parse_Pratt(parent, 0);
+		if (inner == nullptr || index >= token_stream.size() || token_stream[index].type != TokenType::RPARENT) {
+			return nullptr;
+		}
+		index++;
+		return inner;
+	}
+	default:
+		return nullptr;
+	}
+}
+
+void Parser::reduce_Stack()
+{
+	PendingOp op = operator_stack.back();
+	operator_stack.pop_back();
+
+	if (op.unary) {
+		AstNode* operand = operand_stack.back();
+		AstNode* node = new_node(NodeType::UNARYEXP, nullptr);
+		AstNode* unary_op = new_node(NodeType::UNARYOP, node);
+		AstNode* terminal = new_node(NodeType::TERMINAL, unary_op);
+		terminal->token = op.type;
+		unary_op->children.push_back(terminal);
+		operand->parent = node;
+		node->children.push_back(unary_op);
+		node->children.push_back(operand);
+		node->value = apply_unary(op.type, operand->value);
+		operand_stack.back() = node;
+		return;
+	}
+
+	AstNode* rhs = operand_stack.back();
+	operand_stack.pop_back();
+	AstNode* lhs = operand_stack.back();
+	AstNode* node = new_node(infix_binding_power[(int)op.type].node, nullptr);
+	AstNode* terminal = new_node(NodeType::TERMINAL, node);
+	terminal->token = op.type;
+	lhs->parent = node;
+	rhs->parent = node;
+	node->children.push_back(lhs);
+	node->children.push_back(terminal);
+	node->children.push_back(rhs);
+	node->value = apply_binary(op.type, lhs->value, rhs->value, div_by_zero);
+	operand_stack.back() = node;
+}
+
+}  // namespace expr
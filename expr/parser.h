@@ -0,0 +1,604 @@
+#ifndef EXPR_PARSER_H
+#define EXPR_PARSER_H
+
+#include<algorithm>
+#include<cstddef>
+#include<cassert>
+#include<cstdint>
+#include<string>
+#include<vector>
+
+#include "lexer.h"
+
+namespace expr {
+
+// hw2
+enum class NodeType {
+	TERMINAL,  // ս
+	EXP,
+	NUMBER,
+	PRIMARYEXP,
+	UNARYEXP,
+	UNARYOP,
+	MULEXP,
+	ADDEXP,
+	LVAL,
+	NONE
+};
+
+std::string toString(NodeType nt);
+
+// Number of operator new calls made by this thread and the bytes they asked for, so --bench and --stats
+// can tell how much a phase allocated. They stay 0 unless the program replaces operator new to count them.
+inline thread_local uint64_t allocation_count = 0;
+inline thread_local uint64_t allocation_bytes = 0;
+
+// Bump allocator: memory is carved out of large blocks and only given back all at once by reset()
+struct Arena {
+	static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+	Arena() : blocks(), cur(0), ptr(nullptr), end(nullptr), used(0) {}
+	~Arena();
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(size_t size, size_t align);
+
+	/**
+	  *  Func: Release everything allocated so far, the blocks are kept for reuse.
+	  */
+	void reset();
+
+	/**
+	  *  Func: Number of bytes handed out since the last reset.
+	  */
+	size_t bytes_used() const { return used; }
+
+private:
+	struct Block {
+		char* data;
+		size_t size;
+	};
+
+	std::vector<Block> blocks;
+	size_t cur;  // Index of the block ptr points into
+	char* ptr;
+	char* end;
+	size_t used;
+};
+
+// Allocator for standard containers that live in an Arena, deallocate does nothing
+template <typename T>
+struct ArenaAllocator {
+	typedef T value_type;
+
+	Arena* arena;
+
+	explicit ArenaAllocator(Arena& a) : arena(&a) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n) { return (T*)arena->allocate(n * sizeof(T), alignof(T)); }
+	void deallocate(T*, size_t) {}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+// A value of the language, an int or a float. Every literal of a subexpression being known,
+// so is its type: a float if a float literal takes part, an int otherwise.
+struct Value {
+	bool is_float;
+	int i;     // the value of an int
+	double f;  // the value of a float
+};
+
+inline Value int_value(int i) { return Value{ false, i, 0.0 }; }
+inline Value float_value(double f) { return Value{ true, 0, f }; }
+inline double to_double(const Value& v) { return v.is_float ? v.f : (double)v.i; }
+
+// The value of an INTLTR or a FLOATLTR
+inline Value literal_value(const Token& tk) { return tk.type == TokenType::FLOATLTR ? float_value(tk.float_value) : int_value(tk.value); }
+
+// ﷨
+// Nodes and their children lists live in the Arena of the Parser, they are never deleted one by one
+struct AstNode {
+	Value value;
+	NodeType type;  // node type
+	TokenType token;  // the token a TERMINAL stands for
+	uint32_t name;  // of the variable of an LVAL, the index of its name in DFA::names
+	AstNode* parent;
+	std::vector<AstNode*, ArenaAllocator<AstNode*>> children;
+
+	AstNode(Arena& arena, NodeType t = NodeType::NONE, AstNode* p = nullptr) : type(t), token(TokenType::INTLTR), name(0), parent(p), value(), children(ArenaAllocator<AstNode*>(arena)) {}
+
+	AstNode(const AstNode&) = delete;
+	AstNode& operator=(const AstNode&) = delete;
+};
+
+// Integer arithmetic of the language, shared by every evaluator so that they all agree:
+// results wrap around like two's complement, x / 0 gives 0 and sets div_by_zero, INT_MIN / -1 gives INT_MIN.
+inline int apply_binary(TokenType op, int lhs, int rhs, bool& div_by_zero)
+{
+	switch (op) {
+	case TokenType::PLUS: return (int)((unsigned)lhs + (unsigned)rhs);
+	case TokenType::MINU: return (int)((unsigned)lhs - (unsigned)rhs);
+	case TokenType::MULT: return (int)((unsigned)lhs * (unsigned)rhs);
+	case TokenType::DIV:
+		if (rhs == 0) {
+			div_by_zero = true;
+			return 0;
+		}
+		if (rhs == -1) {
+			return (int)(0u - (unsigned)lhs);
+		}
+		return lhs / rhs;
+	default: assert(0 && "invalid binary operator");
+	}
+	return 0;
+}
+
+inline int apply_unary(TokenType op, int v)
+{
+	return op == TokenType::MINU ? (int)(0u - (unsigned)v) : v;
+}
+
+// Float arithmetic is IEEE 754 double: x / 0.0 is an infinity or a NaN, not an error
+inline double apply_float_binary(TokenType op, double lhs, double rhs)
+{
+	switch (op) {
+	case TokenType::PLUS: return lhs + rhs;
+	case TokenType::MINU: return lhs - rhs;
+	case TokenType::MULT: return lhs * rhs;
+	case TokenType::DIV: return lhs / rhs;
+	default: assert(0 && "invalid binary operator");
+	}
+	return 0;
+}
+
+// Like in C, an int operand of a float one is converted to double first
+inline Value apply_binary(TokenType op, const Value& lhs, const Value& rhs, bool& div_by_zero)
+{
+	if (!lhs.is_float && !rhs.is_float) {
+		return int_value(apply_binary(op, lhs.i, rhs.i, div_by_zero));
+	}
+	return float_value(apply_float_binary(op, to_double(lhs), to_double(rhs)));
+}
+
+inline Value apply_unary(TokenType op, const Value& v)
+{
+	if (!v.is_float) {
+		return int_value(apply_unary(op, v.i));
+	}
+	return float_value(op == TokenType::MINU ? -v.f : v.f);
+}
+
+// Binding powers of the operators for Parser::parse_Pratt. An infix operator binds its left operand
+// with left and its right operand with right, right > left makes it left associative.
+// Adding an operator means adding a row here.
+struct BindingPower {
+	uint8_t left;  // 0 if the token is not an infix operator
+	uint8_t right;
+	NodeType node;  // the node an infix operator builds
+};
+
+inline constexpr BindingPower infix_binding_power[] = {
+	{ 0, 0, NodeType::NONE },        // INTLTR
+	{ 10, 11, NodeType::ADDEXP },    // PLUS
+	{ 10, 11, NodeType::ADDEXP },    // MINU
+	{ 20, 21, NodeType::MULEXP },    // MULT
+	{ 20, 21, NodeType::MULEXP },    // DIV
+	{ 0, 0, NodeType::NONE },        // LPARENT
+	{ 0, 0, NodeType::NONE },        // RPARENT
+	{ 0, 0, NodeType::NONE },        // IDENT
+	{ 0, 0, NodeType::NONE },        // FLOATLTR
+};
+
+// Unary '+' and '-' bind tighter than every infix operator, like UnaryExp in MulExp
+inline constexpr uint8_t PREFIX_BINDING_POWER = 30;
+
+enum class ParserKind {
+	RecursiveDescent,  // parse_Exp and the functions below it, one per grammar rule
+	Pratt,             // parse_Pratt with the binding power table
+	Stack              // parse_Stack, the binding power table with explicit stacks instead of recursion
+};
+
+// The Tokens of Parser::token_stream from index on, for the parsers that take any source of Tokens
+struct TokenCursor {
+	const std::vector<Token>& tokens;
+	uint32_t& index;
+
+	const Token* peek() const { return index < tokens.size() ? &tokens[index] : nullptr; }
+	void advance() { index++; }
+};
+
+// The recursive parsers give up past this depth of nested '(' or unary operators and the line is parsed again
+// without recursion, so deep input costs heap memory instead of overflowing the call stack: by parse_Exp_iterative
+// for parse_Exp, which takes exactly the lines parse_Exp takes, and by parse_Stack for parse_Pratt.
+inline constexpr uint32_t MAX_RECURSION_DEPTH = 2000;
+
+// What a Parser did since it was made, for --stats. Each count is an add on a path that does much more, so it is always on.
+struct ParseStats {
+	uint64_t nodes[(int)NodeType::NONE + 1] = {};  // AstNodes made, by NodeType
+	uint64_t backtracks = 0;  // parse_UnaryExp or parse_PrimaryExp tried an alternative after one failed
+	uint64_t rewinds = 0;  // tokens given back to the stream by rules that failed
+	uint64_t restarts = 0;  // lines parsed again without recursion because they nest deeper than MAX_RECURSION_DEPTH
+	uint32_t max_depth = 0;  // deepest recursion of the recursive parsers, or deepest operator_stack of parse_Stack
+
+	void add(const ParseStats& other);
+};
+
+// ﷨ Parser 
+// take a token stream as input, then parsing it, output a AST
+struct Parser {
+	uint32_t index;  // current token index
+	const std::vector<Token>& token_stream;
+	bool div_by_zero;  // set if a division by zero was met, the value of the tree is meaningless then
+	Arena arena;  // owns every AstNode of the current tree
+	ParserKind kind;
+	uint32_t depth;  // nesting of the recursive parsers at index
+	bool too_deep;  // set once depth reached MAX_RECURSION_DEPTH, the recursive parsers unwind then
+	bool has_variable;  // an LVal was parsed, the value of the tree is meaningless without the values of the variables
+	bool literal_out_of_range;  // an int literal was above UINT32_MAX, the value of the tree is meaningless
+	ParseStats stats;  // kept across reset()
+
+	Parser(const std::vector<Token>& tokens) : index(0), token_stream(tokens), div_by_zero(false), arena(), kind(ParserKind::RecursiveDescent), depth(0), too_deep(false), has_variable(false), literal_out_of_range(false), stats() {}
+	~Parser() {}
+
+	/**
+	  *  Func: Get ready to parse token_stream again, the previous tree is released at once.
+	  */
+	void reset() {
+		index = 0;
+		div_by_zero = false;
+		depth = 0;
+		too_deep = false;
+		has_variable = false;
+		literal_out_of_range = false;
+		arena.reset();
+	}
+
+	AstNode* new_node(NodeType t, AstNode* p) {
+		stats.nodes[(int)t]++;
+		return new (arena.allocate(sizeof(AstNode), alignof(AstNode))) AstNode(arena, t, p);
+	}
+
+	/**
+	  *  @brief  creat  the  abstract  syntax  tree
+	  *  @return  the  root  of  abstract  syntax  tree, valid until reset() or the Parser is gone
+	  */
+	AstNode* get_abstract_syntax_tree() {
+		if (token_stream.size() == 0) {
+			return nullptr;
+		}
+		TRACE_SCOPE("parse");
+
+		AstNode* root = new_node(NodeType::EXP, nullptr);
+		bool ok = false;
+		switch (kind) {
+		case ParserKind::RecursiveDescent:
+			ok = parse_Exp(root);
+			break;
+		case ParserKind::Pratt:
+			ok = adopt(root, parse_Pratt(root, 0));
+			break;
+		case ParserKind::Stack: {
+			TokenCursor cursor{ token_stream, index };
+			ok = adopt(root, parse_Stack(cursor, root));
+			break;
+		}
+		}
+
+		if (too_deep) {
+			// Start over without recursion, the nodes made so far stay in the arena until reset()
+			stats.restarts++;
+			index = 0;
+			depth = 0;
+			too_deep = false;
+			restore_flags(FlagMark{ false, false, false });
+			root->children.clear();
+			if (kind == ParserKind::RecursiveDescent) {
+				ok = parse_Exp_iterative(root);
+			}
+			else {
+				TokenCursor cursor{ token_stream, index };
+				ok = adopt(root, parse_Stack(cursor, root));
+			}
+		}
+		return ok ? root : nullptr;
+	}
+
+	/**
+	  *  @brief  creat  the  abstract  syntax  tree  with  parse_Stack,  pulling  the  tokens  one  by  one  from  tokens
+	  *  @param  tokens  anything  with  peek()  and  advance()  like  TokenCursor  or  TokenPuller,  must  not  be  empty
+	  *  @return  the  root  of  abstract  syntax  tree, valid until reset() or the Parser is gone
+	  */
+	template <typename Tokens>
+	AstNode* get_abstract_syntax_tree(Tokens& tokens) {
+		TRACE_SCOPE("parse");
+		AstNode* root = new_node(NodeType::EXP, nullptr);
+		return adopt(root, parse_Stack(tokens, root)) ? root : nullptr;
+	}
+
+	// Exp  ->  AddExp
+	bool parse_Exp(AstNode* root);
+
+	// AddExp  ->  MulExp  {  ('+'  |  '-')  MulExp  }
+	bool parse_AddExp(AstNode* root);
+
+	// MulExp  ->  UnaryExp  {  ('*'  |  '/')  UnaryExp  }
+	bool parse_MulExp(AstNode* root);
+
+	// UnaryExp  ->  PrimaryExp  |  UnaryOp  UnaryExp
+	bool parse_UnaryExp(AstNode* root);
+
+	// PrimaryExp  ->  '('  Exp  ')'  |  Number
+	bool parse_PrimaryExp(AstNode* root);
+
+	// UnaryOp  ->  '+'  |  '-'
+	bool parse_UnaryOp(AstNode* root);
+
+	// Number  ->  IntConst  |  floatConst
+	bool parse_Number(AstNode* root);
+
+	// LVal  ->  Ident
+	bool parse_LVal(AstNode* root);
+
+	// The rules of parse_Exp with the calls between them kept in rule_stack instead of on the call stack, so any
+	// depth of nesting is fine. Makes the same tree and takes and rejects the same tokens as parse_Exp.
+	bool parse_Exp_iterative(AstNode* root);
+
+	// Precedence climbing, used instead of parse_Exp if kind is ParserKind::Pratt.
+	// Parses operators that bind at least as tight as min_bp and returns the subtree, or nullptr.
+	AstNode* parse_Pratt(AstNode* parent, uint8_t min_bp);
+
+	// A number, a parenthesized expression, or a unary operator and its operand
+	AstNode* parse_Prefix(AstNode* parent);
+
+	// Same grammar and tree as parse_Pratt, but the pending operators and operands are kept in
+	// operator_stack and operand_stack, so any depth of nesting is fine. Returns the subtree, or nullptr.
+	// Only one token of lookahead is needed, so tokens may be lexed as they are pulled.
+	template <typename Tokens>
+	AstNode* parse_Stack(Tokens& tokens, AstNode* parent);
+
+private:
+	struct PendingOp {
+		TokenType type;  // LPARENT, or the operator
+		uint8_t right;  // binding power on the right operand
+		bool unary;
+	};
+
+	// kept to save allocations from line to line
+	std::vector<PendingOp> operator_stack;
+	std::vector<AstNode*> operand_stack;
+
+	// Counts one level of nesting of the recursive parsers, from the constructor to the end of the scope
+	struct DepthGuard {
+		uint32_t& depth;
+		explicit DepthGuard(uint32_t& d) : depth(d) { depth++; }
+		~DepthGuard() { depth--; }
+	};
+
+	// The flags about the tree that parse_Exp and the rules below it set. A rule that fails gives its tokens back,
+	// and puts the flags back as they were before it too, so a subtree that was given up leaves nothing behind.
+	struct FlagMark {
+		bool div_by_zero;
+		bool has_variable;
+		bool literal_out_of_range;
+	};
+
+	FlagMark mark_flags() const {
+		return FlagMark{ div_by_zero, has_variable, literal_out_of_range };
+	}
+
+	void restore_flags(const FlagMark& mark) {
+		div_by_zero = mark.div_by_zero;
+		has_variable = mark.has_variable;
+		literal_out_of_range = mark.literal_out_of_range;
+	}
+
+	enum class Rule : uint8_t {
+		Exp,
+		AddExp,
+		MulExp,
+		UnaryExp,
+		PrimaryExp
+	};
+
+	// A call of a rule by parse_Exp_iterative, with the locals of its parse_* function
+	struct RuleFrame {
+		Rule rule;
+		uint8_t step;  // 0 at the start, then where to go on when the rule it called returns
+		AstNode* root;
+		AstNode* child;  // passed to the rule it called
+		uint32_t count;  // operators read by AddExp or MulExp
+		uint32_t record;  // the index of the operator before child
+		FlagMark mark;
+	};
+
+	// kept to save allocations from line to line
+	std::vector<RuleFrame> rule_stack;
+
+	// For the parsers that may recurse too deep: false if they must unwind instead of going one level deeper
+	bool enter_nested() {
+		if (depth >= MAX_RECURSION_DEPTH) {
+			too_deep = true;
+		}
+		stats.max_depth = std::max(stats.max_depth, depth + 1);
+		return !too_deep;
+	}
+
+	// Makes child the only child of root
+	bool adopt(AstNode* root, AstNode* child) {
+		if (child == nullptr) {
+			return false;
+		}
+		child->parent = root;
+		root->children.push_back(child);
+		root->value = child->value;
+		return true;
+	}
+
+	// Pops the operator on top of operator_stack and its operands, pushes the node made of them
+	void reduce_Stack();
+};
+
+template <typename Tokens>
+AstNode* Parser::parse_Stack(Tokens& tokens, AstNode* parent)
+{
+	TRACE_SCOPE("parse_Stack");
+	operator_stack.clear();
+	operand_stack.clear();
+	uint32_t open = 0;  // '(' on operator_stack
+	bool want_operand = true;
+
+	while (const Token* tk = tokens.peek()) {
+		TokenType type = tk->type;
+		if (want_operand) {
+			if (type == TokenType::INTLTR || type == TokenType::FLOATLTR) {
+				AstNode* node = new_node(NodeType::NUMBER, nullptr);
+				node->value = literal_value(*tk);
+				literal_out_of_range |= tk->out_of_range;
+				operand_stack.push_back(node);
+				want_operand = false;
+			}
+			else if (type == TokenType::IDENT) {
+				AstNode* node = new_node(NodeType::LVAL, nullptr);
+				node->name = (uint32_t)tk->value;
+				has_variable = true;
+				operand_stack.push_back(node);
+				want_operand = false;
+			}
+			else if (type == TokenType::PLUS || type == TokenType::MINU) {
+				operator_stack.push_back(PendingOp{ type, PREFIX_BINDING_POWER, true });
+				stats.max_depth = std::max(stats.max_depth, (uint32_t)operator_stack.size());
+			}
+			else if (type == TokenType::LPARENT) {
+				operator_stack.push_back(PendingOp{ type, 0, false });
+				stats.max_depth = std::max(stats.max_depth, (uint32_t)operator_stack.size());
+				open++;
+			}
+			else {
+				return nullptr;
+			}
+			tokens.advance();
+			continue;
+		}
+
+		const BindingPower& bp = infix_binding_power[(int)type];
+		if (bp.left != 0) {
+			while (!operator_stack.empty() && operator_stack.back().type != TokenType::LPARENT && operator_stack.back().right > bp.left) {
+				reduce_Stack();
+			}
+			operator_stack.push_back(PendingOp{ type, bp.right, false });
+			want_operand = true;
+		}
+		else if (type == TokenType::RPARENT && open > 0) {
+			while (operator_stack.back().type != TokenType::LPARENT) {
+				reduce_Stack();
+			}
+			operator_stack.pop_back();
+			open--;
+		}
+		else if (open > 0) {
+			return nullptr;
+		}
+		else {
+			break;  // the rest of the line is not part of the expression, like parse_Pratt
+		}
+		tokens.advance();
+	}
+
+	if (want_operand || open > 0) {
+		return nullptr;
+	}
+	while (!operator_stack.empty()) {
+		reduce_Stack();
+	}
+	AstNode* root = operand_stack.back();
+	root->parent = parent;
+	return root;
+}
+
+// A step of walk_postorder that is still to do
+struct WalkItem {
+	enum What : uint8_t {
+		Visit,   // walk the subtree of node
+		Unary,   // v.unary(op)
+		Binary   // v.binary(op)
+	};
+	const AstNode* node;
+	TokenType op;
+	What what;
+};
+
+/**
+  *  Name: walk_postorder
+  *  Func: Visit the operators and operands of a tree in post-order, whatever shape the grammar gave it.
+  *        Chain nodes like Exp -> AddExp -> MulExp and parentheses are looked through.
+  *        The steps left to do are kept in stack instead of the call stack, so any depth is fine.
+  *  @param[in] node: The root of the tree.
+  *  @param[in] v: Gets v.number(Value), v.variable(name), v.unary(op) and v.binary(op) calls.
+  *  @param[in] stack: Scratch space, emptied first.
+  */
+template <typename Visitor>
+void walk_postorder(const AstNode* node, Visitor& v, std::vector<WalkItem>& stack)
+{
+	stack.clear();
+	stack.push_back(WalkItem{ node, TokenType::INTLTR, WalkItem::Visit });
+	while (!stack.empty()) {
+		WalkItem item = stack.back();
+		stack.pop_back();
+		if (item.what == WalkItem::Unary) {
+			v.unary(item.op);
+			continue;
+		}
+		if (item.what == WalkItem::Binary) {
+			v.binary(item.op);
+			continue;
+		}
+
+		const AstNode* n = item.node;
+		switch (n->type) {
+		case NodeType::NUMBER:
+			v.number(n->value);
+			break;
+		case NodeType::LVAL:
+			v.variable(n->name);
+			break;
+		case NodeType::ADDEXP:
+		case NodeType::MULEXP:
+			// c0 op1 c2 op3 c4 is visited as c0 c2 op1 c4 op3, pushed the other way round
+			for (size_t k = n->children.size() - 1; k >= 2; k -= 2) {
+				stack.push_back(WalkItem{ nullptr, n->children[k - 1]->token, WalkItem::Binary });
+				stack.push_back(WalkItem{ n->children[k], TokenType::INTLTR, WalkItem::Visit });
+			}
+			stack.push_back(WalkItem{ n->children[0], TokenType::INTLTR, WalkItem::Visit });
+			break;
+		case NodeType::UNARYEXP:
+			if (n->children.size() == 1) {
+				stack.push_back(WalkItem{ n->children[0], TokenType::INTLTR, WalkItem::Visit });
+			}
+			else {
+				stack.push_back(WalkItem{ nullptr, n->children[0]->children[0]->token, WalkItem::Unary });
+				stack.push_back(WalkItem{ n->children[1], TokenType::INTLTR, WalkItem::Visit });
+			}
+			break;
+		case NodeType::PRIMARYEXP:
+			stack.push_back(WalkItem{ n->children.size() == 1 ? n->children[0] : n->children[1], TokenType::INTLTR, WalkItem::Visit });
+			break;
+		case NodeType::EXP:
+			stack.push_back(WalkItem{ n->children[0], TokenType::INTLTR, WalkItem::Visit });
+			break;
+		default:
+			assert(0 && "unexpected node in an expression tree");
+		}
+	}
+}
+
+}  // namespace expr
+
+#endif
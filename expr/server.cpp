@@ -0,0 +1,422 @@
+#include<algorithm>
+#include<chrono>
+#include<csignal>
+#include<cstring>
+#include<thread>
+
+#include "server.h"
+
+#ifdef EXPR_SERVER
+#include<cerrno>
+#include<sys/epoll.h>
+#include<sys/eventfd.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+namespace expr {
+
+void LatencyHistogram::record(uint64_t ns)
+{
+	int bucket;
+	if (ns < (uint64_t)SUB_BUCKET_COUNT) {
+		bucket = (int)ns;
+	}
+	else {
+		const int exponent = 63 - __builtin_clzll(ns);
+		const int shift = exponent - SUB_BUCKET_BITS;
+		bucket = (shift + 1) * SUB_BUCKET_COUNT + (int)((ns >> shift) - SUB_BUCKET_COUNT);
+	}
+	counts[bucket]++;
+	total++;
+	max = std::max(max, ns);
+}
+
+uint64_t LatencyHistogram::percentile(double q) const
+{
+	if (total == 0) {
+		return 0;
+	}
+	const uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q * (double)total + 0.5));
+	uint64_t seen = 0;
+	for (int bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+		seen += counts[bucket];
+		if (seen >= rank) {
+			if (bucket < SUB_BUCKET_COUNT) {
+				return (uint64_t)bucket;
+			}
+			const int shift = bucket / SUB_BUCKET_COUNT - 1;
+			const uint64_t first = (uint64_t)(SUB_BUCKET_COUNT + bucket % SUB_BUCKET_COUNT) << shift;
+			return std::min(max, first + ((uint64_t)1 << shift) - 1);
+		}
+	}
+	return max;
+}
+
+#ifdef EXPR_SERVER
+
+static std::atomic<bool> stop_requested(false);
+
+static void request_stop(int)
+{
+	stop_requested.store(true, std::memory_order_relaxed);
+}
+
+static uint64_t steady_ns()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Server::Server(const Options& options, DiskCache* disk_cache)
+	: options(options), disk_cache(disk_cache), evaluators(), epoll_fd(-1), listen_fd(-1), wake_fd(-1), connections(), next_connection(0),
+	  done_mutex(), done(), latency(), accepted(0), requests(0), pool()
+{
+	for (unsigned i = 0; i < options.jobs; i++) {
+		evaluators.emplace_back(new LineEvaluator(options, nullptr, disk_cache));
+	}
+}
+
+Server::~Server()
+{
+	// The tasks still queued write to done and wake_fd
+	pool.reset();
+	for (auto& entry : connections) {
+		::close(entry.second->fd);
+	}
+	for (int fd : { listen_fd, wake_fd, epoll_fd }) {
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+}
+
+bool Server::run(const char* path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (std::strlen(path) >= sizeof(addr.sun_path)) {
+		std::fprintf(stderr, "socket path too long: %s\n", path);
+		return false;
+	}
+	std::strcpy(addr.sun_path, path);
+
+	listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	::unlink(path);
+	if (listen_fd < 0 || ::bind(listen_fd, (const sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listen_fd, SOMAXCONN) != 0) {
+		std::fprintf(stderr, "cannot listen on %s: %s\n", path, std::strerror(errno));
+		return false;
+	}
+	epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd < 0 || wake_fd < 0) {
+		std::fprintf(stderr, "cannot set up epoll: %s\n", std::strerror(errno));
+		return false;
+	}
+	// The data of an event is the id of its connection, the two ids below are never given to one
+	const uint64_t LISTEN_ID = UINT64_MAX;
+	const uint64_t WAKE_ID = UINT64_MAX - 1;
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = LISTEN_ID;
+	::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.u64 = WAKE_ID;
+	::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	pool.reset(new ThreadPool(options.jobs));
+	stop_requested.store(false);
+	std::signal(SIGINT, request_stop);
+	std::signal(SIGTERM, request_stop);
+	std::signal(SIGPIPE, SIG_IGN);
+
+	epoll_event events[64];
+	while (!stop_requested.load(std::memory_order_relaxed)) {
+		// A signal ends the wait with EINTR, epoll_wait is never restarted
+		const int n = ::epoll_wait(epoll_fd, events, 64, -1);
+		if (stats_requested.load(std::memory_order_relaxed) && stats_requested.exchange(false)) {
+			report(stderr);
+		}
+		for (int i = 0; i < n; i++) {
+			const uint64_t id = events[i].data.u64;
+			if (id == LISTEN_ID) {
+				accept_connections();
+				continue;
+			}
+			if (id == WAKE_ID) {
+				uint64_t count;
+				while (::read(wake_fd, &count, sizeof(count)) > 0) {}
+				collect_done();
+				continue;
+			}
+			auto it = connections.find(id);
+			if (it == connections.end()) {
+				continue;  // closed by an earlier event of this round
+			}
+			Connection& c = *it->second;
+			if (!c.read_closed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				read_from(c);
+			}
+			if (connections.count(id) != 0 && (events[i].events & EPOLLOUT)) {
+				write_to(c);
+			}
+		}
+	}
+	::unlink(path);
+	report(stderr);
+	return true;
+}
+
+void Server::accept_connections()
+{
+	for (;;) {
+		const int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;  // EAGAIN once the backlog is empty, or an error the next epoll_wait reports again
+		}
+		accepted++;
+		std::unique_ptr<Connection> c(new Connection());
+		c->fd = fd;
+		c->id = next_connection++;
+		Connection& ref = *c;
+		connections.emplace(c->id, std::move(c));
+		update_events(ref);
+	}
+}
+
+void Server::read_from(Connection& c)
+{
+	char buf[READ_SIZE];
+	const ssize_t n = ::read(c.fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		// The client is done sending, a last line without '\n' still gets a reply
+		c.read_closed = true;
+		if (!c.in.empty()) {
+			submit_batch(c, std::move(c.in) + '\n', steady_ns());
+			c.in.clear();
+		}
+		if (n < 0) {
+			close_connection(c);
+			return;
+		}
+		write_to(c);
+		return;
+	}
+
+	const char* end = buf + n;
+	const char* last_newline = nullptr;
+	for (const char* p = end; p != buf; p--) {
+		if (p[-1] == '\n') {
+			last_newline = p - 1;
+			break;
+		}
+	}
+	if (last_newline == nullptr) {
+		c.in.append(buf, (size_t)n);
+		if (c.in.size() > MAX_LINE_SIZE) {
+			close_connection(c);
+		}
+		return;
+	}
+	std::string lines = std::move(c.in);
+	lines.append(buf, last_newline + 1 - buf);
+	c.in.assign(last_newline + 1, end);
+	submit_batch(c, std::move(lines), steady_ns());
+	update_events(c);
+}
+
+void Server::submit_batch(Connection& c, std::string lines, uint64_t received)
+{
+	const uint64_t connection = c.id;
+	const uint64_t seq = c.next_seq++;
+	pool->submit([this, connection, seq, received, lines = std::move(lines)](unsigned worker) {
+		TRACE_SCOPE("block");
+		LineEvaluator& ev = *evaluators[worker];
+		Done batch{ connection, seq, received, 0, std::string() };
+		const char* p = lines.data();
+		const char* end = p + lines.size();
+		while (p != end) {
+			const char* nl = (const char*)std::memchr(p, '\n', end - p);
+			const char* last = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+			append_result(batch.text, ev.evaluate_line(std::string_view(p, last - p)));
+			batch.lines++;
+			p = nl + 1;
+		}
+		{
+			std::lock_guard<std::mutex> lock(done_mutex);
+			done.push_back(std::move(batch));
+		}
+		const uint64_t one = 1;
+		(void)!::write(wake_fd, &one, sizeof(one));
+	});
+}
+
+void Server::collect_done()
+{
+	std::vector<Done> batches;
+	{
+		std::lock_guard<std::mutex> lock(done_mutex);
+		batches.swap(done);
+	}
+	const uint64_t now = steady_ns();
+	for (Done& batch : batches) {
+		auto it = connections.find(batch.connection);
+		if (it == connections.end()) {
+			continue;  // the client went away before its replies were ready
+		}
+		Connection& c = *it->second;
+		const uint64_t seq = batch.seq;
+		c.waiting.emplace(seq, std::move(batch));
+		for (auto next = c.waiting.begin(); next != c.waiting.end() && next->first == c.next_reply; next = c.waiting.erase(next)) {
+			Done& ready = next->second;
+			c.out += ready.text;
+			requests += ready.lines;
+			for (uint32_t i = 0; i < ready.lines; i++) {
+				latency.record(now - ready.received);
+			}
+			c.next_reply++;
+		}
+		write_to(c);
+	}
+}
+
+void Server::write_to(Connection& c)
+{
+	while (c.out_offset < c.out.size()) {
+		const ssize_t n = ::write(c.fd, c.out.data() + c.out_offset, c.out.size() - c.out_offset);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				break;
+			}
+			close_connection(c);
+			return;
+		}
+		c.out_offset += (size_t)n;
+	}
+	if (c.out_offset == c.out.size()) {
+		c.out.clear();
+		c.out_offset = 0;
+	}
+	if (c.read_closed && c.out.empty() && c.next_reply == c.next_seq) {
+		close_connection(c);
+		return;
+	}
+	update_events(c);
+}
+
+void Server::update_events(Connection& c)
+{
+	uint32_t events = 0;
+	if (!c.read_closed && c.out.size() - c.out_offset < MAX_PENDING_OUTPUT && c.next_seq - c.next_reply < MAX_BATCHES_IN_FLIGHT) {
+		events |= EPOLLIN;
+	}
+	if (c.out_offset < c.out.size()) {
+		events |= EPOLLOUT;
+	}
+	if (events == c.events) {
+		return;
+	}
+	// A connection that waits for nothing is taken out, epoll would report its hang up over and over
+	epoll_event ev = {};
+	ev.events = events;
+	ev.data.u64 = c.id;
+	::epoll_ctl(epoll_fd, events == 0 ? EPOLL_CTL_DEL : c.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c.fd, &ev);
+	c.events = events;
+}
+
+void Server::close_connection(Connection& c)
+{
+	::close(c.fd);  // which takes it out of epoll
+	connections.erase(c.id);
+}
+
+void Server::report(std::FILE* f) const
+{
+	std::fprintf(f, "{\"connections\":%llu,\"open\":%zu,\"requests\":%llu,\"latency_us\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}}\n",
+		(unsigned long long)accepted, connections.size(), (unsigned long long)requests, latency.percentile(0.5) / 1e3, latency.percentile(0.9) / 1e3,
+		latency.percentile(0.99) / 1e3, latency.max / 1e3);
+	std::fflush(f);
+}
+
+bool run_client(const char* path, InputReader& in)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (std::strlen(path) >= sizeof(addr.sun_path)) {
+		std::fprintf(stderr, "socket path too long: %s\n", path);
+		return false;
+	}
+	std::strcpy(addr.sun_path, path);
+	const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || ::connect(fd, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+		std::fprintf(stderr, "cannot connect to %s: %s\n", path, std::strerror(errno));
+		if (fd >= 0) {
+			::close(fd);
+		}
+		return false;
+	}
+	std::signal(SIGPIPE, SIG_IGN);
+
+	// Requests are sent while the replies come back, or a long input would fill both socket buffers and stall
+	std::thread sender([fd, &in]() {
+		const char* data;
+		size_t size;
+		while (in.next_chunk(data, size)) {
+			while (size > 0) {
+				const ssize_t n = ::write(fd, data, size);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					return;
+				}
+				data += n;
+				size -= (size_t)n;
+			}
+		}
+		::shutdown(fd, SHUT_WR);
+	});
+	char buf[Server::READ_SIZE];
+	for (;;) {
+		const ssize_t n = ::read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		std::fwrite(buf, 1, (size_t)n, stdout);
+	}
+	sender.join();
+	::close(fd);
+	return true;
+}
+
+#else
+
+Server::Server(const Options& options, DiskCache* disk_cache)
+	: options(options), disk_cache(disk_cache), evaluators(), epoll_fd(-1), listen_fd(-1), wake_fd(-1), connections(), next_connection(0),
+	  done_mutex(), done(), latency(), accepted(0), requests(0), pool()
+{
+}
+
+Server::~Server() {}
+
+bool Server::run(const char*)
+{
+	std::fputs("the server needs epoll, it is not built on this platform\n", stderr);
+	return false;
+}
+
+bool run_client(const char*, InputReader&)
+{
+	std::fputs("the client is not built on this platform\n", stderr);
+	return false;
+}
+
+#endif
+
+}  // namespace expr
@@ -0,0 +1,126 @@
+#ifndef EXPR_SERVER_H
+#define EXPR_SERVER_H
+
+#include<cstdint>
+#include<cstdio>
+#include<map>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<unordered_map>
+#include<vector>
+
+#include "line_evaluator.h"
+#include "parallel.h"
+
+#if defined(__linux__)
+#define EXPR_SERVER
+#endif
+
+namespace expr {
+
+// Latencies in nanoseconds. Below 16 every value has its own bucket, above that each power of two is cut
+// into 16 buckets, so a percentile is at most 1/16 above the true one and recording is a few instructions.
+struct LatencyHistogram {
+	static constexpr int SUB_BUCKET_BITS = 4;
+	static constexpr int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+	static constexpr int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+	uint64_t counts[BUCKET_COUNT] = {};
+	uint64_t total = 0;
+	uint64_t max = 0;
+
+	void record(uint64_t ns);
+
+	/**
+	  *  Func: The latency that a fraction q of the recorded ones do not exceed, like 0.99 for p99.
+	  *  @return: The upper end of the bucket it falls in, 0 if nothing was recorded.
+	  */
+	uint64_t percentile(double q) const;
+};
+
+// Serves expressions over a Unix domain socket: a client sends lines, each one an expression, and gets one
+// line back for each, an empty one too, with the value or the error homework2 prints for it, in the order it sent them.
+// One thread multiplexes every connection with epoll. The lines that arrive in one read go to a
+// ThreadPool as a batch and are evaluated by the LineEvaluator of the worker that takes them. Batches of a
+// connection can finish out of order, their replies wait in the connection until every earlier one is sent.
+struct Server {
+	static constexpr size_t READ_SIZE = 1 << 16;
+	static constexpr size_t MAX_LINE_SIZE = 1 << 20;  // a connection that sends a longer line is closed
+	static constexpr size_t MAX_PENDING_OUTPUT = 1 << 22;  // stop reading from a client that does not read its replies
+	static constexpr size_t MAX_BATCHES_IN_FLIGHT = 64;  // per connection
+
+	/**
+	  *  @param[in] options: Of the LineEvaluators, options.jobs of them. The columns are not used.
+	  *  @param[in] disk_cache: Shared by the workers, nullptr if not used.
+	  */
+	Server(const Options& options, DiskCache* disk_cache);
+	~Server();
+
+	Server(const Server&) = delete;
+	Server& operator=(const Server&) = delete;
+
+	/**
+	  *  Func: Listen on path and serve until SIGINT or SIGTERM, then print the connection and request counts and the
+	  *        latency percentiles to stderr as JSON. Setting stats_requested prints them at once. An old socket file at path is replaced.
+	  *  @return: False if the socket cannot be set up, the reason is on stderr.
+	  */
+	bool run(const char* path);
+
+private:
+	// The replies of one batch of lines
+	struct Done {
+		uint64_t connection;
+		uint64_t seq;
+		uint64_t received;  // when the batch was read, in steady clock nanoseconds
+		uint32_t lines;
+		std::string text;
+	};
+
+	struct Connection {
+		int fd;
+		uint64_t id;
+		std::string in;  // bytes after the last '\n' read so far
+		std::string out;  // replies ready to send, from out_offset on
+		size_t out_offset = 0;
+		uint64_t next_seq = 0;  // of the next batch read
+		uint64_t next_reply = 0;  // seq of the batch whose replies go out next
+		std::map<uint64_t, Done> waiting;  // finished batches after next_reply
+		uint32_t events = 0;  // what epoll watches the fd for
+		bool read_closed = false;
+	};
+
+	void accept_connections();
+	void read_from(Connection& c);
+	void submit_batch(Connection& c, std::string lines, uint64_t received);
+	void collect_done();
+	void write_to(Connection& c);
+	void update_events(Connection& c);
+	void close_connection(Connection& c);
+	void report(std::FILE* f) const;
+
+	const Options& options;
+	DiskCache* disk_cache;
+	std::vector<std::unique_ptr<LineEvaluator>> evaluators;  // one per worker
+	int epoll_fd;
+	int listen_fd;
+	int wake_fd;  // an eventfd the workers write to when a batch is done
+	std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;
+	uint64_t next_connection;
+	std::mutex done_mutex;
+	std::vector<Done> done;  // finished batches not yet collected
+	LatencyHistogram latency;  // from reading a line to its reply being ready to send
+	uint64_t accepted;
+	uint64_t requests;
+	std::unique_ptr<ThreadPool> pool;  // last, so that it finishes its tasks before the rest goes
+};
+
+/**
+  *  Func: The client of a Server: send every line of in to the socket at path and copy the replies to stdout.
+  *  @return: False if the server cannot be reached.
+  */
+bool run_client(const char* path, InputReader& in);
+
+}  // namespace expr
+
+#endif
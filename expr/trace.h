@@ -0,0 +1,143 @@
+#ifndef EXPR_TRACE_H
+#define EXPR_TRACE_H
+
+#include<algorithm>
+#include<atomic>
+#include<chrono>
+#include<cstdint>
+#include<cstdio>
+#include<memory>
+#include<mutex>
+#include<vector>
+
+//#define TRACE
+
+namespace expr {
+
+// The tracer: begin and end events of the phases and of every parse_* production, written as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev) at exit. Each thread records into its own ring of the last
+// TRACE_RING_SIZE events without locks, an event costs a read of the time stamp counter and a store.
+// Without TRACE, TRACE_SCOPE is nothing at all.
+#ifdef TRACE
+
+struct TraceEvent {
+	uint64_t ticks;
+	const char* name;  // a string literal
+	char phase;  // 'B' or 'E'
+};
+
+inline constexpr size_t TRACE_RING_SIZE = 1 << 18;  // a power of two
+
+// Written by its thread only, read once that thread is done
+struct TraceRing {
+	TraceEvent events[TRACE_RING_SIZE];
+	std::atomic<uint64_t> head{ 0 };  // number of events recorded, the last TRACE_RING_SIZE of them are kept
+	uint32_t tid = 0;
+
+	void record(const char* name, char phase, uint64_t ticks) {
+		const uint64_t h = head.load(std::memory_order_relaxed);
+		events[h & (TRACE_RING_SIZE - 1)] = TraceEvent{ ticks, name, phase };
+		head.store(h + 1, std::memory_order_release);
+	}
+};
+
+inline uint64_t trace_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline uint64_t trace_now_ns()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Every ring ever made, they live until exit so that the events of finished threads can be written
+struct Tracer {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<TraceRing>> rings;
+	uint64_t start_ticks = trace_ticks();  // with start_ns, to turn ticks into time
+	uint64_t start_ns = trace_now_ns();
+
+	static Tracer& instance() {
+		static Tracer tracer;
+		return tracer;
+	}
+
+	TraceRing* new_ring() {
+		std::lock_guard<std::mutex> lock(mutex);
+		rings.emplace_back(new TraceRing());
+		rings.back()->tid = (uint32_t)rings.size();
+		return rings.back().get();
+	}
+
+	/**
+	  *  Func: Write the events of all the rings as Chrome trace JSON. The threads that recorded them must be done.
+	  *  @return: False if path cannot be written.
+	  */
+	bool write(const char* path);
+};
+
+inline thread_local TraceRing* trace_ring = nullptr;
+
+inline void trace_event(const char* name, char phase)
+{
+	if (trace_ring == nullptr) {
+		trace_ring = Tracer::instance().new_ring();
+	}
+	trace_ring->record(name, phase, trace_ticks());
+}
+
+inline bool Tracer::write(const char* path)
+{
+	std::FILE* f = std::fopen(path, "w");
+	if (f == nullptr) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	const double ns_per_tick = (double)(trace_now_ns() - start_ns) / (double)std::max<uint64_t>(1, trace_ticks() - start_ticks);
+
+	std::fputs("{\"traceEvents\":[\n", f);
+	bool first = true;
+	for (const auto& ring : rings) {
+		const uint64_t head = ring->head.load(std::memory_order_acquire);
+		const uint64_t begin = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		uint32_t depth = 0;  // an end whose begin was overwritten is left out
+		for (uint64_t i = begin; i < head; i++) {
+			const TraceEvent& e = ring->events[i & (TRACE_RING_SIZE - 1)];
+			if (e.phase == 'E' && depth == 0) {
+				continue;
+			}
+			depth += e.phase == 'B' ? 1 : -1;
+			const double us = (double)(int64_t)(e.ticks - start_ticks) * ns_per_tick / 1000.0;
+			std::fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", first ? "" : ",\n", e.name, e.phase, us, ring->tid);
+			first = false;
+		}
+	}
+	std::fputs("\n]}\n", f);
+	return std::fclose(f) == 0;
+}
+
+// Records a begin event now and the end event when the scope is left
+struct TraceScope {
+	const char* name;
+	explicit TraceScope(const char* name) : name(name) { trace_event(name, 'B'); }
+	~TraceScope() { trace_event(name, 'E'); }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) expr::TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+
+#endif
+
+}  // namespace expr
+
+#endif
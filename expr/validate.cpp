@@ -0,0 +1,244 @@
+#include<cstdlib>
+
+#include "validate.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEXER_SIMD_X86
+#include<immintrin.h>
+#endif
+
+namespace expr {
+
+std::string toString(LineError e)
+{
+	switch (e) {
+	case LineError::None: return "none";
+	case LineError::MissingOperand: return "missing_operand";
+	case LineError::UnclosedParen: return "unclosed_paren";
+	default: assert(0 && "invalid LineError");
+	}
+	return "";
+}
+
+// Where a check is after the tokens before i
+struct CheckState {
+	bool expects_operand;  // the token before is an operator or '(', or there is none
+	bool seen_open;  // a '(' came before
+	uint32_t depth;  // of '(' before the token
+};
+
+// The Parsers all agree with the check, but parse_Exp, which takes back fewer tokens than it read when a ')'
+// is missing and may then find an expression after all: an error after a '(' is only an error for the others.
+static TokenCheck found(LineError error, size_t i, const CheckState& s, bool recursive_descent)
+{
+	if (recursive_descent && (s.seen_open || error == LineError::UnclosedParen)) {
+		return TokenCheck{ LineError::None, (uint32_t)i };
+	}
+	return TokenCheck{ error, (uint32_t)i };
+}
+
+// The tokens from i on one at a time, also the tail and the block with an event of the vector kernels
+static TokenCheck check_scalar_from(const Token* tokens, size_t i, size_t n, CheckState s, bool recursive_descent)
+{
+	for (; i < n; i++) {
+		switch (tokens[i].type) {
+		case TokenType::INTLTR:
+		case TokenType::FLOATLTR:
+		case TokenType::IDENT:
+			if (!s.expects_operand) {
+				// Nothing joins it to the expression before, which ends there
+				return s.depth > 0 ? found(LineError::UnclosedParen, i, s, recursive_descent) : TokenCheck{ LineError::None, (uint32_t)i };
+			}
+			s.expects_operand = false;
+			break;
+		case TokenType::LPARENT:
+			if (!s.expects_operand) {
+				return s.depth > 0 ? found(LineError::UnclosedParen, i, s, recursive_descent) : TokenCheck{ LineError::None, (uint32_t)i };
+			}
+			s.depth++;
+			s.seen_open = true;
+			break;
+		case TokenType::PLUS:
+		case TokenType::MINU:
+			s.expects_operand = true;  // a unary one if an operand was expected
+			break;
+		case TokenType::MULT:
+		case TokenType::DIV:
+			if (s.expects_operand) {
+				return found(LineError::MissingOperand, i, s, recursive_descent);
+			}
+			s.expects_operand = true;
+			break;
+		case TokenType::RPARENT:
+			if (s.expects_operand) {
+				return found(LineError::MissingOperand, i, s, recursive_descent);
+			}
+			if (s.depth == 0) {
+				return TokenCheck{ LineError::None, (uint32_t)i };
+			}
+			s.depth--;
+			break;
+		}
+	}
+	if (s.expects_operand) {
+		return found(LineError::MissingOperand, n, s, recursive_descent);
+	}
+	if (s.depth > 0) {
+		return found(LineError::UnclosedParen, n, s, recursive_descent);
+	}
+	return TokenCheck{ LineError::None, (uint32_t)n };
+}
+
+static TokenCheck check_scalar(const Token* tokens, size_t n, bool recursive_descent)
+{
+	return check_scalar_from(tokens, 0, n, CheckState{ true, false, 0 }, recursive_descent);
+}
+
+// The kernels below look at a block of tokens at once for an event, where check_scalar_from would stop:
+// '*', '/' or ')' where an operand is expected, an operand or '(' where an operator is, or a ')' at depth 0.
+// A block without one only moves the CheckState on, the block with one is left to check_scalar_from.
+
+#ifdef LEXER_SIMD_X86
+__attribute__((target("sse2")))
+static TokenCheck check_sse2(const Token* tokens, size_t n, bool recursive_descent)
+{
+	CheckState s{ true, false, 0 };
+	alignas(16) uint8_t types[16];
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		for (size_t k = 0; k < 16; k++) {
+			types[k] = (uint8_t)tokens[i + k].type;
+		}
+		const __m128i t = _mm_load_si128((const __m128i*)types);
+		const __m128i operand = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(t, _mm_set1_epi8((char)TokenType::INTLTR)),
+			_mm_cmpeq_epi8(t, _mm_set1_epi8((char)TokenType::FLOATLTR))), _mm_cmpeq_epi8(t, _mm_set1_epi8((char)TokenType::IDENT)));
+		const __m128i infix = _mm_or_si128(_mm_cmpeq_epi8(t, _mm_set1_epi8((char)TokenType::MULT)), _mm_cmpeq_epi8(t, _mm_set1_epi8((char)TokenType::DIV)));
+		const __m128i open = _mm_cmpeq_epi8(t, _mm_set1_epi8((char)TokenType::LPARENT));
+		const __m128i close = _mm_cmpeq_epi8(t, _mm_set1_epi8((char)TokenType::RPARENT));
+
+		// Every token but an operand and ')' wants an operand after it, each lane gets the one of the lane before
+		const __m128i complete = _mm_or_si128(operand, close);
+		const __m128i expects_before = _mm_or_si128(_mm_slli_si128(_mm_xor_si128(complete, _mm_set1_epi8(-1)), 1),
+			_mm_cvtsi32_si128(s.expects_operand ? 0xFF : 0));
+
+		// The depth before each lane: +1 for '(' and -1 for ')', the masks are -1, summed in four shifts
+		__m128i sum = _mm_sub_epi8(close, open);
+		sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 1));
+		sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 2));
+		sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 4));
+		sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 8));
+		// 64 or more deep stays above 0 for a whole block, so the carry is clamped to fit the lanes
+		const __m128i depth_before = _mm_add_epi8(_mm_slli_si128(sum, 1), _mm_set1_epi8((char)(s.depth < 64 ? s.depth : 64)));
+		const __m128i at_top = _mm_cmpeq_epi8(depth_before, _mm_setzero_si128());
+
+		const __m128i missing = _mm_and_si128(expects_before, _mm_or_si128(infix, close));
+		const __m128i joined = _mm_andnot_si128(expects_before, _mm_or_si128(operand, open));
+		const __m128i ends = _mm_andnot_si128(expects_before, _mm_and_si128(close, at_top));
+		if (_mm_movemask_epi8(_mm_or_si128(missing, _mm_or_si128(joined, ends))) != 0) {
+			return check_scalar_from(tokens, i, n, s, recursive_descent);
+		}
+
+		s.expects_operand = ((unsigned)_mm_movemask_epi8(complete) >> 15) == 0;
+		s.seen_open |= _mm_movemask_epi8(open) != 0;
+		s.depth += (int8_t)(_mm_cvtsi128_si32(_mm_srli_si128(sum, 15)) & 0xFF);
+	}
+	return check_scalar_from(tokens, i, n, s, recursive_descent);
+}
+
+// Each lane gets the byte of the lane before, lane 0 gets 0. The byte shifts of AVX2 stay inside each
+// 128 bit half, so lane 16 takes the last byte of the low half from a copy of it moved up.
+__attribute__((target("avx2")))
+static inline __m256i shift1_avx2(__m256i v)
+{
+	return _mm256_alignr_epi8(v, _mm256_permute2x128_si256(v, v, 0x08), 15);
+}
+
+__attribute__((target("avx2")))
+static TokenCheck check_avx2(const Token* tokens, size_t n, bool recursive_descent)
+{
+	CheckState s{ true, false, 0 };
+	alignas(32) uint8_t types[32];
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		for (size_t k = 0; k < 32; k++) {
+			types[k] = (uint8_t)tokens[i + k].type;
+		}
+		const __m256i t = _mm256_load_si256((const __m256i*)types);
+		const __m256i operand = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(t, _mm256_set1_epi8((char)TokenType::INTLTR)),
+			_mm256_cmpeq_epi8(t, _mm256_set1_epi8((char)TokenType::FLOATLTR))), _mm256_cmpeq_epi8(t, _mm256_set1_epi8((char)TokenType::IDENT)));
+		const __m256i infix = _mm256_or_si256(_mm256_cmpeq_epi8(t, _mm256_set1_epi8((char)TokenType::MULT)), _mm256_cmpeq_epi8(t, _mm256_set1_epi8((char)TokenType::DIV)));
+		const __m256i open = _mm256_cmpeq_epi8(t, _mm256_set1_epi8((char)TokenType::LPARENT));
+		const __m256i close = _mm256_cmpeq_epi8(t, _mm256_set1_epi8((char)TokenType::RPARENT));
+
+		const __m256i complete = _mm256_or_si256(operand, close);
+		const __m256i expects_before = _mm256_or_si256(shift1_avx2(_mm256_xor_si256(complete, _mm256_set1_epi8(-1))),
+			_mm256_set_epi64x(0, 0, 0, s.expects_operand ? 0xFF : 0));
+
+		// Prefix sum inside each half, then the total of the low half is added to the high one
+		__m256i sum = _mm256_sub_epi8(close, open);
+		sum = _mm256_add_epi8(sum, _mm256_slli_si256(sum, 1));
+		sum = _mm256_add_epi8(sum, _mm256_slli_si256(sum, 2));
+		sum = _mm256_add_epi8(sum, _mm256_slli_si256(sum, 4));
+		sum = _mm256_add_epi8(sum, _mm256_slli_si256(sum, 8));
+		const __m256i low_total = _mm256_permute2x128_si256(_mm256_shuffle_epi8(sum, _mm256_set1_epi8(15)), sum, 0x08);
+		sum = _mm256_add_epi8(sum, low_total);
+		const __m256i depth_before = _mm256_add_epi8(shift1_avx2(sum), _mm256_set1_epi8((char)(s.depth < 64 ? s.depth : 64)));
+		const __m256i at_top = _mm256_cmpeq_epi8(depth_before, _mm256_setzero_si256());
+
+		const __m256i missing = _mm256_and_si256(expects_before, _mm256_or_si256(infix, close));
+		const __m256i joined = _mm256_andnot_si256(expects_before, _mm256_or_si256(operand, open));
+		const __m256i ends = _mm256_andnot_si256(expects_before, _mm256_and_si256(close, at_top));
+		const unsigned events = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(missing, _mm256_or_si256(joined, ends)));
+		const unsigned complete_mask = (unsigned)_mm256_movemask_epi8(complete);
+		const unsigned open_mask = (unsigned)_mm256_movemask_epi8(open);
+		const int total = (int8_t)(_mm256_extract_epi8(sum, 31) & 0xFF);
+		if (events != 0) {
+			_mm256_zeroupper();
+			return check_scalar_from(tokens, i, n, s, recursive_descent);
+		}
+
+		s.expects_operand = (complete_mask >> 31) == 0;
+		s.seen_open |= open_mask != 0;
+		s.depth += total;
+	}
+	_mm256_zeroupper();
+	return check_scalar_from(tokens, i, n, s, recursive_descent);
+}
+#endif
+
+typedef TokenCheck (*TokenChecker)(const Token* tokens, size_t n, bool recursive_descent);
+
+struct TokenCheckers {
+	TokenChecker check;
+	const char* name;
+};
+
+// Pick the kernel once at startup, VALIDATE_SIMD=scalar|sse2 forces a narrower one
+static TokenCheckers select_token_checker()
+{
+	TokenCheckers scalar = { check_scalar, "scalar" };
+	const char* env = std::getenv("VALIDATE_SIMD");
+	std::string wanted = env ? env : "";
+	if (wanted == "scalar") {
+		return scalar;
+	}
+#ifdef LEXER_SIMD_X86
+	__builtin_cpu_init();
+	if (wanted != "sse2" && __builtin_cpu_supports("avx2")) {
+		return { check_avx2, "avx2" };
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return { check_sse2, "sse2" };
+	}
+#endif
+	return scalar;
+}
+
+static const TokenCheckers token_checker = select_token_checker();
+
+TokenCheck check_tokens(const Token* tokens, size_t n, ParserKind kind)
+{
+	return token_checker.check(tokens, n, kind == ParserKind::RecursiveDescent);
+}
+
+}  // namespace expr
@@ -0,0 +1,40 @@
+#ifndef EXPR_VALIDATE_H
+#define EXPR_VALIDATE_H
+
+#include<cstddef>
+#include<cstdint>
+#include<string>
+
+#include "parser.h"
+
+namespace expr {
+
+// Why the tokens of a line cannot be an expression, found before the Parser runs
+enum class LineError : uint8_t {
+	None,            // nothing wrong was found, the Parser decides
+	MissingOperand,  // '+', '-', '*', '/', '(' or the start of the line followed by '*', '/', ')' or the end of the line
+	UnclosedParen,   // the expression ends, at the end of the line or at a token no operator joins to it, inside '('
+	Count
+};
+
+std::string toString(LineError e);
+
+struct TokenCheck {
+	LineError error;
+	uint32_t token;  // the index of the token the check stopped at, the number of tokens if it got to the end
+};
+
+/**
+  *  Func: Check the token types of a line the way the Parser would see them: the class of each token, operators
+  *        next to each other and the depth of '(' before each token, a prefix sum of +1 for '(' and -1 for ')'.
+  *        Blocks of 16 or 32 tokens are checked at once with the widest instructions the CPU has,
+  *        VALIDATE_SIMD=scalar|sse2 forces a narrower kernel.
+  *  @param[in] kind: The Parser that would run. An error is only reported if that Parser gives an invalid
+  *                   expression for the line, parse_Exp is only judged up to the first '(' for that.
+  *  @return: error is None if the line may be an expression, or the tokens after one.
+  */
+TokenCheck check_tokens(const Token* tokens, size_t n, ParserKind kind);
+
+}  // namespace expr
+
+#endif
@@ -0,0 +1,108 @@
+#include<cstdio>
+#include<cstring>
+
+#include "writer.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define OUTPUT_WRITE
+#include<cerrno>
+#include<unistd.h>
+#endif
+
+namespace expr {
+
+static void append_le(std::string& out, uint64_t v, size_t bytes)
+{
+	char buf[8];
+	for (size_t i = 0; i < bytes; i++) {
+		buf[i] = (char)(v >> (8 * i));
+	}
+	out.append(buf, bytes);
+}
+
+void append_binary_int(std::string& out, int32_t v)
+{
+	append_le(out, (uint32_t)v, 4);
+}
+
+void append_binary_float(std::string& out, double v)
+{
+	uint64_t bits;
+	std::memcpy(&bits, &v, sizeof(bits));
+	append_le(out, bits, 8);
+}
+
+void append_binary_token(std::string& out, const Token& tk, std::string_view text)
+{
+	out += (char)((uint8_t)tk.type | (tk.out_of_range ? BINARY_OUT_OF_RANGE : 0));
+	switch (tk.type) {
+	case TokenType::INTLTR:
+		append_binary_int(out, tk.value);
+		break;
+	case TokenType::FLOATLTR:
+		append_binary_float(out, tk.float_value);
+		break;
+	case TokenType::IDENT:
+		append_le(out, text.size(), 4);
+		out.append(text.data(), text.size());
+		break;
+	default:
+		break;
+	}
+}
+
+bool write_all(int fd, const char* data, size_t size)
+{
+#ifdef OUTPUT_WRITE
+	while (size > 0) {
+		const ssize_t n = ::write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		size -= (size_t)n;
+	}
+	return true;
+#else
+	std::FILE* f = fd == 2 ? stderr : stdout;
+	return std::fwrite(data, 1, size, f) == size && std::fflush(f) == 0;
+#endif
+}
+
+OutputWriter::OutputWriter(int fd)
+	: fd(fd), buffer()
+{
+	buffer.reserve(CHUNK_SIZE);
+}
+
+OutputWriter::~OutputWriter()
+{
+	flush();
+}
+
+void OutputWriter::write(std::string_view text)
+{
+	if (buffer.size() + text.size() <= CHUNK_SIZE) {
+		buffer.append(text.data(), text.size());
+		return;
+	}
+	flush();
+	if (text.size() >= CHUNK_SIZE) {
+		write_all(fd, text.data(), text.size());
+	}
+	else {
+		buffer.append(text.data(), text.size());
+	}
+}
+
+bool OutputWriter::flush()
+{
+	const bool ok = write_all(fd, buffer.data(), buffer.size());
+	buffer.clear();
+	return ok;
+}
+
+}  // namespace expr
@@ -0,0 +1,87 @@
+#ifndef EXPR_WRITER_H
+#define EXPR_WRITER_H
+
+#include<cstddef>
+#include<cstdint>
+#include<string>
+#include<string_view>
+
+#include "lexer.h"
+
+namespace expr {
+
+// How the tokens and the results are printed
+enum class OutputFormat {
+	Text,   // a line per token, 'INTLTR  12', and a line per result, '12' or 'error: ...'
+	Binary  // the records below, for tools that would rather not parse the text
+};
+
+// The binary format starts with BINARY_MAGIC, then a record per token and per result, in the order of the text.
+// A record is a tag byte and its payload, numbers are little endian:
+//   - a token: its TokenType, with BINARY_OUT_OF_RANGE set if the literal does not fit. An INTLTR is followed
+//     by its int32 value, a FLOATLTR by its float64 value, an IDENT by a uint32 length and the name;
+//   - a result: one of BinaryTag, a value is followed by the int32 or the float64.
+// A line without tokens has no records, like it has no lines in the text.
+inline constexpr char BINARY_MAGIC[8] = { 'E', 'X', 'P', 'R', 'B', 'I', 'N', '1' };
+constexpr uint8_t BINARY_OUT_OF_RANGE = 0x80;
+
+// The tags of the results, 0x10 plus the LineStatus for the errors
+enum class BinaryTag : uint8_t {
+	IntValue = 0x10,
+	FloatValue = 0x11,
+	Invalid = 0x12,
+	DivByZero = 0x13,
+	Unbound = 0x14,
+	OutOfRange = 0x15
+};
+
+/**
+  *  Func: Append the record of a token.
+  *  @param[in] text: The text of the token, the name of an IDENT is taken from it.
+  */
+void append_binary_token(std::string& out, const Token& tk, std::string_view text);
+
+void append_binary_int(std::string& out, int32_t v);
+void append_binary_float(std::string& out, double v);
+
+/**
+  *  Func: Write all of data to a file descriptor, a write(2) may take only part of it.
+  *  @return: False if the descriptor gave an error.
+  */
+bool write_all(int fd, const char* data, size_t size);
+
+// Output gathered in a big buffer and written with one write(2) per CHUNK_SIZE, instead of a stdio call
+// per line. Text of a whole chunk or more is written as it is, without copying it into the buffer.
+struct OutputWriter {
+	static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+	explicit OutputWriter(int fd = 1);  // stdout by default
+	~OutputWriter();
+
+	OutputWriter(const OutputWriter&) = delete;
+	OutputWriter& operator=(const OutputWriter&) = delete;
+
+	void write(std::string_view text);
+
+	/**
+	  *  Func: Write the buffer once it holds a whole chunk, for those that append to buffer directly.
+	  */
+	void flush_if_full() {
+		if (buffer.size() >= CHUNK_SIZE) {
+			flush();
+		}
+	}
+
+	/**
+	  *  Func: Write the buffer.
+	  *  @return: False if a write failed, the output is lost then.
+	  */
+	bool flush();
+
+	int fd;
+	std::string buffer;
+};
+
+}  // namespace expr
+
+#endif
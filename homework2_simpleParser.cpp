@@ -5,9 +5,11 @@ Exp  ->  AddExp
 
 Number  ->  IntConst  |  floatConst
 
-PrimaryExp  ->  '('  Exp  ')'  |  Number
+PrimaryExp  ->  '('  Exp  ')'  |  LVal  |  Number
 		PrimaryExp.v
 
+LVal  ->  Ident
+
 UnaryExp  ->  PrimaryExp  |  UnaryOp  UnaryExp
 		UnaryExp.v
 
@@ -21,655 +23,756 @@ AddExp  ->  MulExp  {  ('+'  |  '-')  MulExp  }
 */
 #include<map>
 #include<cassert>
+#include<cstdint>
+#include<cstdlib>
 #include<string>
+#include<string_view>
+#include<cstring>
 #include<iostream>
 #include<vector>
 #include<set>
+#include<list>
+#include<unordered_map>
 #include<queue>
+#include<cstdio>
+#include<new>
+#include<deque>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<functional>
+#include<memory>
+#include<atomic>
+#include<algorithm>
+#include<charconv>
+#include<cmath>
+#include<cfloat>
+#include<chrono>
+#include<csignal>
+
+#if defined(__linux__)
+#define PERF_COUNTERS
+#include<linux/perf_event.h>
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+#endif
+
+#include "expr/line_evaluator.h"
+#include "expr/parallel.h"
+#include "expr/server.h"
 
 #define TODO assert(0 && "TODO")
-//#define DEBUG_DFA
-//#define DEBUG_PARSER
 
-int char2digit(char c);
-int compute_value(std::string str);
+using namespace expr;
 
-enum class State
+// Counts into expr::allocation_count and expr::allocation_bytes for --bench and --stats.
+// Not inlined, like the ones of the standard library: gcc would see malloc meet operator delete and warn
+__attribute__((noinline)) void* operator new(size_t size)
 {
-	Empty,       // space, \n, \r, ...
-	IntLiteral,  // int literal, like '1', '01900', '0xAB', '0b11001', ...
-	op           // operators and '(', ')'.
-};
+	allocation_count++;
+	allocation_bytes += size;
+	void* p = std::malloc(size == 0 ? 1 : size);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
 
-std::string toString(State s)
+__attribute__((noinline)) void operator delete(void* p) noexcept
 {
-	switch (s) {
-	case State::Empty: return "Empty";
-	case State::IntLiteral: return "IntLiteral";
-	case State::op: return "op";
-	default: assert(0 && "invalid State");
-	}
-	return "";
+	std::free(p);
 }
 
-enum class TokenType
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
 {
-	INTLTR,   // int literal
-	PLUS,     // '+'
-	MINU,     // '-'
-	MULT,     // '*'
-	DIV,      // '/'
-	LPARENT,  // '('
-	RPARENT   // ')'
-};
+	std::free(p);
+}
 
+static void request_stats(int)
+{
+	stats_requested.store(true, std::memory_order_relaxed);
+}
 
-std::string toString(TokenType type)
+// The numbers of --eval=dag go to stderr, so that stdout stays the same as with the other evaluators
+void report_sharing(const ExprDag& dag)
 {
-	switch (type)
-	{
-	case TokenType::INTLTR: return "INTLTR";
-	case TokenType::PLUS: return "PLUS";
-	case TokenType::MINU: return "MINU";
-	case TokenType::MULT: return "MULT";
-	case TokenType::DIV: return "DIV";
-	case TokenType::LPARENT: return "LPARENT";
-	case TokenType::RPARENT: return "RPARENT";
-	default: assert(0 && "invalid token type");
-	}
-	return "";
+	std::fprintf(stderr, "dag: %llu nodes, %llu distinct, sharing ratio %.2f\n",
+		(unsigned long long)dag.visited, (unsigned long long)dag.created, dag.sharing_ratio());
 }
 
+void report_cache(const CacheStats& stats)
+{
+	std::fprintf(stderr, "cache: %llu hits, %llu disk hits, %llu misses\n",
+		(unsigned long long)stats.hits, (unsigned long long)stats.disk_hits, (unsigned long long)stats.misses);
+}
 
-struct Token
+/**
+  *  Func: Evaluate the input on a pool of jobs threads, the output keeps the input order.
+  */
+void run_parallel(InputReader& in, const Options& options, OutputWriter& writer, DiskCache* disk_cache, const ColumnTable* columns)
 {
-	TokenType type;
-	std::string value;
-};
+	const unsigned jobs = options.jobs;
+	static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+	std::vector<std::unique_ptr<LineEvaluator>> evaluators;
+	for (unsigned i = 0; i < jobs; i++) {
+		evaluators.emplace_back(new LineEvaluator(options, nullptr, disk_cache, columns));
+	}
+	ReorderBuffer reorder;
+	size_t submitted = 0;
+	size_t written = 0;
+	const size_t max_in_flight = 4 * (size_t)jobs;  // Bounds the memory held by blocks and their output
+	Stats stats;  // of the blocks done so far
+	std::mutex stats_mutex;
+
+	auto write_next = [&]() {
+		std::string text = reorder.take(written++);
+		writer.write(text);
+		if (stats_requested.load(std::memory_order_relaxed) && stats_requested.exchange(false)) {
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			print_stats(stats, stderr);
+		}
+	};
 
+	ThreadPool pool(jobs);
+	split_blocks(in, BLOCK_SIZE, [&](InputBlock&& block) {
+		while (submitted - written >= max_in_flight) {
+			write_next();
+		}
+		size_t seq = submitted++;
+		pool.submit([&evaluators, &reorder, &stats, &stats_mutex, seq, block = std::move(block)](unsigned worker) {
+			TRACE_SCOPE("block");
+			LineEvaluator& ev = *evaluators[worker];
+			MemoryInput src(block.begin(), block.length());
+			ev.run(src);
+			{
+				std::lock_guard<std::mutex> lock(stats_mutex);
+				ev.take_stats(stats);
+			}
+			reorder.put(seq, std::move(ev.out));
+			ev.out.clear();
+		});
+	});
+	while (written < submitted) {
+		write_next();
+	}
+	writer.flush();
+
+	if (options.eval == EvalMode::Dag) {
+		ExprDag total;
+		for (auto& ev : evaluators) {
+			total.visited += ev->dag.visited;
+			total.created += ev->dag.created;
+		}
+		report_sharing(total);
+	}
+	if (options.cache > 0 || disk_cache != nullptr) {
+		CacheStats total;
+		for (auto& ev : evaluators) {
+			total.hits += ev->cache_stats.hits;
+			total.disk_hits += ev->cache_stats.disk_hits;
+			total.misses += ev->cache_stats.misses;
+		}
+		report_cache(total);
+	}
+	if (options.stats) {
+		print_stats(stats, stderr);
+	}
+}
 
-struct  DFA {
-	DFA();
-	~DFA();
+// Cycles, instructions and branch misses of this thread in user space, read with perf_event_open.
+// ok() is false where there is no such counter or it is not allowed, see /proc/sys/kernel/perf_event_paranoid.
+struct PerfCounters {
+	static constexpr int COUNT = 3;
 
-	// Do not allow copy and assignment
-	DFA(const DFA&) = delete;
-	DFA& operator=(const DFA&) = delete;
+	PerfCounters();
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	bool ok() const { return fds[0] >= 0; }
 
 	/**
-	  *  Name: next
-	  *  Func: Take a char as input, change state to next state, and output a Token if necessary.
-	  *  @param[in] input: The input character.
-	  *  @param[out] buf: The output Token buffer
-	  *  @return: True if a Token is produced, i.e. the buf is valid.
+	  *  Func: Zero the counters and start counting.
 	  */
-	bool next(char input, Token& buf);
+	void start();
 
 	/**
-	  *  Func: Reset the DFA state to begin.
+	  *  Func: Stop counting.
+	  *  @param[out] values: cycles, instructions and branch misses since start().
 	  */
-	void reset();
+	void stop(uint64_t values[COUNT]);
 
 private:
-	State cur_state;  // Record current state of the DFA
-	std::string cur_str;  // Record input characters
+	int fds[COUNT];  // fds[0] leads the group, so the three count over the same time
 };
 
-
-DFA::DFA() : cur_state(State::Empty), cur_str() {}
-DFA::~DFA() {}
-
-//bool is_operator(char c)
-//{
-//    return (c == '+' || c == '-' || c == '*' || c == '/' || c == '(' || c == ')' || c == '\n');
-//}
-
-TokenType get_op_type(std::string s)
+PerfCounters::PerfCounters()
 {
-	if (s.size() > 1) {
-		return TokenType::INTLTR;
-	}
-	char c = s[0];
-	switch (c) {
-	case '+': return TokenType::PLUS;
-	case '-': return TokenType::MINU;
-	case '*': return TokenType::MULT;
-	case '/': return TokenType::DIV;
-	case '(': return TokenType::LPARENT;
-	case ')': return TokenType::RPARENT;
-	default: break;
+	for (int& fd : fds) {
+		fd = -1;
+	}
+#ifdef PERF_COUNTERS
+	static const uint64_t configs[COUNT] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES };
+	for (int k = 0; k < COUNT; k++) {
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[k];
+		attr.disabled = k == 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		fds[k] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, k == 0 ? -1 : fds[0], 0);
+		if (fds[k] < 0) {
+			for (int j = 0; j < k; j++) {
+				close(fds[j]);
+				fds[j] = -1;
+			}
+			return;
+		}
 	}
+#endif
 }
 
-bool DFA::next(char input, Token& buf)
+PerfCounters::~PerfCounters()
 {
-	if (input == ' ') {
-		return false;
-	}
-
-	cur_str += input;
-
-	switch (cur_state) {
-	case State::Empty:
-		if ((input >= '0' && input <= '9') || (input >= 'a' && input <= 'z') || (input >= 'A' && input <= 'Z')) {
-			cur_state = State::IntLiteral;
-			return false;
+#ifdef PERF_COUNTERS
+	for (int fd : fds) {
+		if (fd >= 0) {
+			close(fd);
 		}
-		else if (input == '(' || input == '-') {
-			cur_state = State::op;
-			buf.type = get_op_type(cur_str);
-			buf.value = cur_str;
-			cur_str = "";
-			return true;
-		}
-		else {
-			cur_state = State::Empty;
-			cur_str = "";
-			return false;
-		}
-
-	case State::IntLiteral:
-		if ((input >= '0' && input <= '9') || (input >= 'a' && input <= 'z') || (input >= 'A' && input <= 'Z')) {
-			cur_state = State::IntLiteral;
-			return false;
-		}
-		else if (input == '+' || input == '-' || input == '*' || input == '/' || input == '(' || input == ')' || input == '\n') {
-			cur_state = State::op;
-			buf.type = TokenType::INTLTR;
-			cur_str.pop_back();
-			buf.value = cur_str;
-			cur_str = input;
-			return true;
-		}
-		else {
-			cur_state = State::Empty;
-			cur_str = "";
-			return false;
-		}
-
-	case State::op:
-		if (cur_str.size() == 2) {
-			if ((input >= '0' && input <= '9') || (input >= 'a' && input <= 'z') || (input >= 'A' && input <= 'Z')) {
-				cur_state = State::IntLiteral;
-			}
-			else if (input == '+' || input == '-' || input == '*' || input == '/' || input == '(' || input == ')' || input == '\n') {
-				cur_state = State::op;
-			}
-			else {
-				cur_state = State::Empty;
-			}
-			cur_str.pop_back();
-			buf.type = get_op_type(cur_str);
-			buf.value = cur_str;
-			cur_str = input;
-			return true;
-		}
-		else {
-			if ((input >= '0' && input <= '9') || (input >= 'a' && input <= 'z') || (input >= 'A' && input <= 'Z')) {
-				cur_state = State::IntLiteral;
-				buf.type = TokenType::INTLTR;
-				buf.value = input;
-				return false;
-			}
-			else if (input == '+' || input == '-' || input == '*' || input == '/' || input == '(' || input == ')' || input == '\n') {
-				cur_state = State::op;
-				buf.type = get_op_type(cur_str);
-				buf.value = cur_str;
-				cur_str = "";
-				return true;
-			}
-			else {
-				cur_state = State::Empty;
-				cur_str = "";
-				return false;
-			}
-		}
-
-	default:
-		return false;
 	}
+#endif
 }
 
-void DFA::reset()
+void PerfCounters::start()
 {
-	cur_state = State::Empty;
-	cur_str = "";
-}
-
-// hw2
-enum class NodeType {
-	TERMINAL,  // ս
-	EXP,
-	NUMBER,
-	PRIMARYEXP,
-	UNARYEXP,
-	UNARYOP,
-	MULEXP,
-	ADDEXP,
-	NONE
-};
-
-std::string toString(NodeType nt) {
-	switch (nt) {
-	case  NodeType::TERMINAL:  return  "Terminal";
-	case  NodeType::EXP:  return  "Exp";
-	case  NodeType::NUMBER:  return  "Number";
-	case  NodeType::PRIMARYEXP:  return  "PrimaryExp";
-	case  NodeType::UNARYEXP:  return  "UnaryExp";
-	case  NodeType::UNARYOP:  return  "UnaryOp";
-	case  NodeType::MULEXP:  return  "MulExp";
-	case  NodeType::ADDEXP:  return  "AddExp";
-	case  NodeType::NONE:  return  "NONE";
-	default:
-		assert(0 && "invalid  node  type");
-		break;
-	}
-	return  "";
-}
-
-// ﷨
-struct AstNode {
-	int value;
-	NodeType type;  // node type
-	AstNode* parent;
-	std::vector<AstNode*> children;
-
-	AstNode(NodeType t = NodeType::NONE, AstNode* p = nullptr) : type(t), parent(p), value(0) {}
-
-	virtual  ~AstNode() 
-	{
-		for (auto child : children) {
-			delete child;
-		}
+#ifdef PERF_COUNTERS
+	if (ok()) {
+		ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
 	}
+#endif
+}
 
-	AstNode(const AstNode&) = delete;
-	AstNode& operator=(const AstNode&) = delete;
-};
-
-// ﷨ Parser 
-// take a token stream as input, then parsing it, output a AST
-struct Parser {
-	uint32_t index;  // current token index
-	const std::vector<Token>& token_stream;
-
-	Parser(const std::vector<Token>& tokens) : index(0), token_stream(tokens) {}
-	~Parser() {}
-
-	/**
-	  *  @brief  creat  the  abstract  syntax  tree
-	  *  @return  the  root  of  abstract  syntax  tree
-	  */
-	AstNode* get_abstract_syntax_tree() {
-		if (token_stream.size() == 0) {
-			return nullptr;
-		}
-
-		AstNode* root = new AstNode(NodeType::EXP, nullptr);
-		if (parse_Exp(root)) {
-			return root;
-		}
-		else {
-			return nullptr;
+void PerfCounters::stop(uint64_t values[COUNT])
+{
+	for (int k = 0; k < COUNT; k++) {
+		values[k] = 0;
+	}
+#ifdef PERF_COUNTERS
+	if (ok()) {
+		ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		uint64_t group[1 + COUNT];  // the number of counters, then their values
+		if (read(fds[0], group, sizeof(group)) == (ssize_t)sizeof(group)) {
+			for (int k = 0; k < COUNT; k++) {
+				values[k] = group[1 + k];
+			}
 		}
 	}
+#endif
+}
 
-	// Exp  ->  AddExp
-	bool parse_Exp(AstNode* root);
-
-	// AddExp  ->  MulExp  {  ('+'  |  '-')  MulExp  }
-	bool parse_AddExp(AstNode* root);
-
-	// MulExp  ->  UnaryExp  {  ('*'  |  '/')  UnaryExp  }
-	bool parse_MulExp(AstNode* root);
-
-	// UnaryExp  ->  PrimaryExp  |  UnaryOp  UnaryExp
-	bool parse_UnaryExp(AstNode* root);
-
-	// PrimaryExp  ->  '('  Exp  ')'  |  Number
-	bool parse_PrimaryExp(AstNode* root);
-
-	// UnaryOp  ->  '+'  |  '-'
-	bool parse_UnaryOp(AstNode* root);
+// SplitMix64, the workloads only depend on the seed, not on the standard library
+struct BenchRandom {
+	uint64_t state;
 
-	// Number  ->  IntConst  |  floatConst
-	bool parse_Number(AstNode* root);
+	explicit BenchRandom(uint64_t seed) : state(seed) {}
 
-// for debug, u r not required to use this
-// how to use this: in ur local enviroment, defines the macro DEBUG_PARSER and add this function in every parse fuction
-	void log(AstNode* node) {
-#ifdef DEBUG_PARSER
-		std::cout << "in parse" << toString(node->type) << ", cur_token_type::" << toString(token_stream[index].type) << ", token_val::" << token_stream[index].value << 'n';
-#endif
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
 	}
 
+	// Uniform enough in [0, n) for the small n used here
+	uint32_t below(uint32_t n) { return (uint32_t)(next() % n); }
 };
 
+struct BenchWorkload {
+	const char* name;
+	std::string text;  // lines of expressions, each ending with '\n'
+};
 
-bool Parser::parse_Exp(AstNode* root)
+static void append_small_number(std::string& out, BenchRandom& rng)
 {
-	AstNode* child = new AstNode(NodeType::ADDEXP, root);
-	if (parse_AddExp(child)) {
-		root->children.push_back(child);
-		root->value = child->value;
-		return true;
-	}
-	else {
-		root->children.clear();
-		return false;
-	}
+	out += std::to_string(1 + rng.below(999));
 }
 
-
-bool Parser::parse_AddExp(AstNode* root)
+static void append_binary_op(std::string& out, BenchRandom& rng)
 {
-	AstNode* child_1 = new AstNode(NodeType::MULEXP, root);
-	if (parse_MulExp(child_1)) {
-		root->children.push_back(child_1);
-		root->value = child_1->value;
-	}
-	else {
-		root->children.clear();
-		return false;
-	}
-
-	//  { } 
-	if (index >= token_stream.size()) {
-		return true;
-	}
-
-	int count = 0;
-	while (token_stream[index].type == TokenType::PLUS || token_stream[index].type == TokenType::MINU) {
-		int record = index;  // ¼λ
-
-		AstNode* child_2 = new AstNode(NodeType::TERMINAL, root);
-		root->children.push_back(child_2);
-		index++;
-		count++;
-
-		AstNode* child_3 = new AstNode(NodeType::MULEXP, root);
-		if (parse_MulExp(child_3)) {
-			root->children.push_back(child_3);
-			if (token_stream[record].type == TokenType::PLUS) {
-				root->value += child_3->value;
-			}
-			else {
-				root->value -= child_3->value;
-			}
-		}
-		else {
-			root->children.clear();
-			while (count--) {
-				index--;
-			}
-			return false;
-		}
+	static const char ops[] = { '+', '-', '*', '/' };
+	out += ops[rng.below(4)];
+}
 
-		if (index >= token_stream.size()) {
-			break;
+// Lines of 1000 operands joined by '+', '-', '*' and '/', so the chains of AddExp and MulExp get long
+static std::string make_chain_workload(BenchRandom& rng)
+{
+	std::string out;
+	for (int line = 0; line < 600; line++) {
+		append_small_number(out, rng);
+		for (int k = 1; k < 1000; k++) {
+			append_binary_op(out, rng);
+			append_small_number(out, rng);
 		}
+		out += '\n';
 	}
-
-	return true;
+	return out;
 }
 
-
-bool Parser::parse_MulExp(AstNode* root)
+// Lines like '((1+2)*3)-4', nested 500 deep, and some nested past MAX_RECURSION_DEPTH
+static std::string make_nesting_workload(BenchRandom& rng)
 {
-	AstNode* child_1 = new AstNode(NodeType::UNARYEXP, root);
-	if (parse_UnaryExp(child_1)) {
-		root->children.push_back(child_1);
-		root->value = child_1->value;
-	}
-	else {
-		root->children.clear();
-		return false;
+	std::string out;
+	for (int line = 0; line < 400; line++) {
+		const uint32_t depth = line % 8 == 0 ? MAX_RECURSION_DEPTH + 500 : 500;
+		out.append(depth, '(');
+		append_small_number(out, rng);
+		for (uint32_t k = 0; k < depth; k++) {
+			append_binary_op(out, rng);
+			append_small_number(out, rng);
+			out += ')';
+		}
+		out += '\n';
 	}
+	return out;
+}
 
-	//  { } 
-	if (index >= token_stream.size()) {
-		return true;
+// Lines like '-+--7', 1000 unary operators deep
+static std::string make_unary_workload(BenchRandom& rng)
+{
+	std::string out;
+	for (int line = 0; line < 1000; line++) {
+		for (int k = 0; k < 1000; k++) {
+			out += rng.below(4) == 0 ? '+' : '-';
+		}
+		append_small_number(out, rng);
+		out += '\n';
 	}
+	return out;
+}
 
-	int count = 0;
-	while (token_stream[index].type == TokenType::MULT || token_stream[index].type == TokenType::DIV) {
-		int record = index;  // ¼λ
-
-		AstNode* child_2 = new AstNode(NodeType::TERMINAL, root);
-		root->children.push_back(child_2);
-		index++;
-		count++;
-
-		AstNode* child_3 = new AstNode(NodeType::UNARYEXP, root);
-		if (parse_UnaryExp(child_3)) {
-			root->children.push_back(child_3);
-			if (token_stream[record].type == TokenType::MULT) {
-				root->value *= child_3->value;
-			}
-			else {
-				root->value /= child_3->value;
+// Lines of 16 hex, binary and octal literals of up to 32 bits, joined by '+'
+static std::string make_literal_workload(BenchRandom& rng)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+	std::string out;
+	for (int line = 0; line < 20000; line++) {
+		for (int k = 0; k < 16; k++) {
+			if (k > 0) {
+				out += '+';
 			}
-		}
-		else {
-			root->children.clear();
-			while (count--) {
-				index--;
+			switch (rng.below(3)) {
+			case 0:
+				out += "0x";
+				for (uint32_t n = 1 + rng.below(8); n > 0; n--) {
+					out += hex_digits[rng.below(16)];
+				}
+				break;
+			case 1:
+				out += "0b1";
+				for (uint32_t n = rng.below(32); n > 0; n--) {
+					out += (char)('0' + rng.below(2));
+				}
+				break;
+			default:
+				out += "01";
+				for (uint32_t n = rng.below(10); n > 0; n--) {
+					out += (char)('0' + rng.below(8));
+				}
+				break;
 			}
-			return false;
-		}
-
-		if (index >= token_stream.size()) {
-			break;
 		}
+		out += '\n';
 	}
-
-	return true;
+	return out;
 }
 
-
-bool Parser::parse_UnaryExp(AstNode* root)
+// Many lines like '12 + 7', where the cost of a line is mostly the cost of starting one
+static std::string make_short_line_workload(BenchRandom& rng)
 {
-	AstNode* child_1 = new AstNode(NodeType::PRIMARYEXP, root);
-	if (parse_PrimaryExp(child_1)) {
-		root->children.push_back(child_1);
-		root->value = child_1->value;
-		return true;
-	}
-
-	int record = index;  // ¼ UnaryOp ķλ
-	AstNode* child_2 = new AstNode(NodeType::UNARYOP, root);
-	if (parse_UnaryOp(child_2)) {
-		root->children.push_back(child_2);
-	}
-	else {
-		root->children.clear();
-		return false;
-	}
-
-	AstNode* child_3 = new AstNode(NodeType::UNARYEXP, root);
-	if (parse_UnaryExp(child_3)) {
-		root->children.push_back(child_3);
-		if (token_stream[record].type == TokenType::PLUS) {
-			root->value = child_3->value;
-		}
-		else {
-			root->value = -child_3->value;
-		}
-	}
-	else {
-		root->children.clear();
-		return false;
-	}
-
-	return true;
+	std::string out;
+	for (int line = 0; line < 200000; line++) {
+		append_small_number(out, rng);
+		out += ' ';
+		append_binary_op(out, rng);
+		out += ' ';
+		append_small_number(out, rng);
+		out += '\n';
+	}
+	return out;
 }
 
-
-bool Parser::parse_PrimaryExp(AstNode* root)
+std::vector<BenchWorkload> make_bench_workloads(uint64_t seed)
 {
-	AstNode* child = new AstNode(NodeType::NUMBER, root);
-	if (parse_Number(child)) {
-		root->children.push_back(child);
-		root->value = child->value;
-		return true;
-	}
+	std::vector<BenchWorkload> workloads;
+	BenchRandom rng(seed);
+	workloads.push_back(BenchWorkload{ "chain", make_chain_workload(rng) });
+	workloads.push_back(BenchWorkload{ "nesting", make_nesting_workload(rng) });
+	workloads.push_back(BenchWorkload{ "unary", make_unary_workload(rng) });
+	workloads.push_back(BenchWorkload{ "literals", make_literal_workload(rng) });
+	workloads.push_back(BenchWorkload{ "short_lines", make_short_line_workload(rng) });
+	return workloads;
+}
 
-	if (token_stream[index].type == TokenType::LPARENT) {
-		AstNode* child_1 = new AstNode(NodeType::TERMINAL, root);
-		root->children.push_back(child_1);
-		index++;
-	}
-	else {
-		root->children.clear();
-		return false;
-	}
+// What one phase did over a whole workload, in the fastest of the runs
+struct BenchResult {
+	double seconds = 0;
+	uint64_t bytes = 0;
+	uint64_t tokens = 0;
+	uint64_t nodes = 0;
+	uint64_t allocations = 0;
+	uint64_t counters[PerfCounters::COUNT] = {};
+};
 
-	AstNode* child_2 = new AstNode(NodeType::EXP, root);
-	if (parse_Exp(child_2)) {
-		root->children.push_back(child_2);
-		root->value = child_2->value;
-	}
-	else {
-		root->children.clear();
-		index--;
-		return false;
-	}
+static constexpr int BENCH_RUNS = 5;
 
-	if (token_stream[index].type == TokenType::RPARENT) {
-		AstNode* child_3 = new AstNode(NodeType::TERMINAL, root);
-		root->children.push_back(child_3);
-		index++;
-	}
-	else {
-		root->children.clear();
-		root->value = 0;
-		index -= 2;
-		return false;
+/**
+  *  Func: Time a phase BENCH_RUNS times and keep the fastest run. The first run also warms up the caches and
+  *        makes the allocations that are kept from run to run.
+  *  @param[in] phase: Called with no argument, does the whole work once.
+  */
+template <typename Phase>
+BenchResult time_phase(PerfCounters& perf, Phase&& phase)
+{
+	BenchResult best;
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		BenchResult r;
+		const uint64_t allocations = allocation_count;
+		perf.start();
+		auto begin = std::chrono::steady_clock::now();
+		phase();
+		auto end = std::chrono::steady_clock::now();
+		perf.stop(r.counters);
+		r.allocations = allocation_count - allocations;
+		r.seconds = std::chrono::duration<double>(end - begin).count();
+		if (run == 0 || r.seconds < best.seconds) {
+			best = r;
+		}
 	}
-
-	return true;
+	return best;
 }
 
-
-bool Parser::parse_UnaryOp(AstNode* root)
+// Counts the AstNodes of a tree, including the terminals
+static uint64_t count_nodes(const AstNode* root, std::vector<const AstNode*>& stack)
 {
-	if (token_stream[index].type == TokenType::PLUS || token_stream[index].type == TokenType::MINU) {
-		AstNode* child = new AstNode(NodeType::TERMINAL, root);
-		root->children.push_back(child);
-		index++;
-		return true;
-	}
-	else {
-		root->children.clear();
-		return false;
+	uint64_t n = 0;
+	stack.clear();
+	stack.push_back(root);
+	while (!stack.empty()) {
+		const AstNode* node = stack.back();
+		stack.pop_back();
+		n++;
+		for (const AstNode* child : node->children) {
+			stack.push_back(child);
+		}
 	}
+	return n;
 }
 
-
-bool Parser::parse_Number(AstNode* root)
+// One JSON object per line, so that the output of two builds can be compared line by line
+static void print_bench_result(const char* workload, const char* phase, uint64_t seed, const BenchResult& r, bool has_counters)
 {
-	if (token_stream[index].type == TokenType::INTLTR) {
-		AstNode* child = new AstNode(NodeType::TERMINAL, root);
-		child->value = compute_value(token_stream[index].value);
-		root->children.push_back(child);
-		root->value = child->value;
-		index++;
-		return true;
+	auto per_second = [&r](uint64_t n) { return r.seconds > 0 ? n / r.seconds : 0.0; };
+	std::printf("{\"workload\":\"%s\",\"phase\":\"%s\",\"seed\":%llu,\"seconds\":%.6f,\"bytes\":%llu,\"tokens\":%llu,\"nodes\":%llu,"
+		"\"bytes_per_s\":%.0f,\"tokens_per_s\":%.0f,\"nodes_per_s\":%.0f,\"allocations\":%llu,",
+		workload, phase, (unsigned long long)seed, r.seconds, (unsigned long long)r.bytes, (unsigned long long)r.tokens,
+		(unsigned long long)r.nodes, per_second(r.bytes), per_second(r.tokens), per_second(r.nodes), (unsigned long long)r.allocations);
+	if (has_counters) {
+		std::printf("\"cycles\":%llu,\"instructions\":%llu,\"branch_misses\":%llu}\n",
+			(unsigned long long)r.counters[0], (unsigned long long)r.counters[1], (unsigned long long)r.counters[2]);
 	}
 	else {
-		root->children.clear();
-		return false;
+		std::printf("\"cycles\":null,\"instructions\":null,\"branch_misses\":null}\n");
 	}
 }
 
-
-int char2digit(char c)
+/**
+  *  Name: run_bench
+  *  Func: Generate the workloads from options.bench_seed and time each phase on each of them:
+  *        lex runs the DFA over the whole text, parse builds the tree of every line with options.parser,
+  *        eval runs the Program compiled from every tree. One line of JSON is printed per workload and phase.
+  */
+void run_bench(const Options& options)
 {
-	return c - '0';
+	PerfCounters perf;
+	if (!perf.ok()) {
+		std::fprintf(stderr, "bench: no hardware counters, cycles, instructions and branch misses are null\n");
+	}
+
+	for (BenchWorkload& workload : make_bench_workloads(options.bench_seed)) {
+		// The lines and their tokens, found once here so that the phases below only time themselves
+		std::vector<Token> all_tokens;
+		std::vector<size_t> line_ends;  // all_tokens[line_ends[i - 1], line_ends[i]) are the tokens of line i
+		DFA dfa;
+		MemoryInput src(workload.text.data(), workload.text.size());
+		lex_lines(src, dfa,
+			[&all_tokens](const Token& tk, std::string_view) { all_tokens.push_back(tk); },
+			[&all_tokens, &line_ends]() { line_ends.push_back(all_tokens.size()); });
+
+		std::vector<Token> tokens;
+		Parser parser(tokens);
+		parser.kind = options.parser;
+		std::vector<Program> programs(line_ends.size());
+		std::vector<const AstNode*> node_stack;
+		FlatAst flat;
+		uint64_t ast_nodes = 0;
+		uint64_t program_nodes = 0;  // numbers and operators, like the nodes of a FlatAst
+		for (size_t i = 0, first = 0; i < line_ends.size(); first = line_ends[i++]) {
+			tokens.assign(all_tokens.begin() + first, all_tokens.begin() + line_ends[i]);
+			parser.reset();
+			const AstNode* root = parser.get_abstract_syntax_tree();
+			if (root != nullptr) {
+				ast_nodes += count_nodes(root, node_stack);
+				compile(root, programs[i]);
+				flatten(root, flat);
+				program_nodes += flat.size();
+			}
+		}
+
+		volatile uint64_t sink = 0;  // keeps the work of the phases from being optimized away
+		BenchResult lex = time_phase(perf, [&]() {
+			uint64_t n = 0;
+			MemoryInput in(workload.text.data(), workload.text.size());
+			lex_lines(in, dfa, [&n](const Token& tk, std::string_view) { n += tk.type == TokenType::INTLTR; }, []() {});
+			sink = sink + n;
+		});
+		lex.bytes = workload.text.size();
+		lex.tokens = all_tokens.size();
+		print_bench_result(workload.name, "lex", options.bench_seed, lex, perf.ok());
+
+		BenchResult parse = time_phase(perf, [&]() {
+			for (size_t i = 0, first = 0; i < line_ends.size(); first = line_ends[i++]) {
+				tokens.assign(all_tokens.begin() + first, all_tokens.begin() + line_ends[i]);
+				parser.reset();
+				sink = sink + (parser.get_abstract_syntax_tree() != nullptr);
+			}
+		});
+		parse.tokens = all_tokens.size();
+		parse.nodes = ast_nodes;
+		print_bench_result(workload.name, "parse", options.bench_seed, parse, perf.ok());
+
+		Program::Stack program_stack;
+		BenchResult eval = time_phase(perf, [&]() {
+			for (const Program& program : programs) {
+				if (!program.code.empty()) {
+					bool div_by_zero = false;
+					sink = sink + (uint64_t)program.run(program_stack, div_by_zero).i;
+				}
+			}
+		});
+		eval.nodes = program_nodes;
+		print_bench_result(workload.name, "eval", options.bench_seed, eval, perf.ok());
+	}
 }
 
-int compute_value(std::string str)
+int main(int argc, char* argv[])
 {
-	if (str.empty()) {
+	// Usage: homework2 [--jobs N] [--eval=tree|flat|vm|jit|dag] [--parser=rd|pratt|stack] [--fused] [--cache N] [--cache-file PATH] [--columns CSV] [--stats] [--trace PATH] [--format=text|binary] [file]
+	//        homework2 --bench[=SEED] [--parser=rd|pratt|stack]
+	//        homework2 --serve SOCKET [--jobs N] [--eval=...] [--parser=...] [--cache N] [--cache-file PATH]
+	//        homework2 --connect SOCKET [file]
+	// Expressions are read one per line, from file or from stdin. With --jobs the lines are
+	// evaluated on N threads (0 means one per core), the output order stays the same.
+	// --fused lexes each line only as far as the parser has read it, always with the stack parser:
+	// the other two may have to go back over tokens already read.
+	// --cache keeps the results of the last N distinct lines of each thread, --cache-file keeps results in
+	// a file from one run to the next; both report hits and misses on stderr. Neither is used with --fused.
+	// Identifiers are variables, a line that uses one is an error unless --columns gives their values:
+	// a CSV file with a header line of names and a line of values per row. Every line is then
+	// evaluated for each row, and gets one result per row.
+	// --stats prints counts of tokens, nodes, parser backtracking and allocations and the time of each phase as JSON on
+	// stderr at exit, and the ones so far at the next line after a SIGUSR1.
+	// Built with TRACE, the phases and the parse_* productions of every line are written to --trace, trace.json by
+	// default, as a Chrome trace. Without TRACE, --trace does nothing.
+	// --format=binary prints the tokens and the results as the records of expr/writer.h instead of text.
+	// --bench reads no input: it times the lexer, the parser and the evaluator on workloads generated from SEED
+	// and prints one line of JSON per workload and phase.
+	// --serve evaluates the lines clients send to a Unix socket on N worker threads and sends each client one line
+	// per line back, only the result, in order. It runs until SIGINT or SIGTERM and prints the request count and
+	// latency percentiles as JSON on stderr then and after a SIGUSR1. --connect is such a client: it sends the input
+	// to the server and prints the replies.
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if ((arg == "--jobs" || arg == "-j") && i + 1 < argc) {
+			options.jobs = (unsigned)std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (arg.compare(0, 7, "--jobs=") == 0) {
+			options.jobs = (unsigned)std::strtoul(arg.c_str() + 7, nullptr, 10);
+		}
+		else if (arg == "--eval=tree") {
+			options.eval = EvalMode::Tree;
+		}
+		else if (arg == "--eval=flat") {
+			options.eval = EvalMode::Flat;
+		}
+		else if (arg == "--eval=vm") {
+			options.eval = EvalMode::Vm;
+		}
+		else if (arg == "--eval=jit") {
+			options.eval = EvalMode::Jit;
+		}
+		else if (arg == "--eval=dag") {
+			options.eval = EvalMode::Dag;
+		}
+		else if (arg == "--parser=rd") {
+			options.parser = ParserKind::RecursiveDescent;
+		}
+		else if (arg == "--parser=pratt") {
+			options.parser = ParserKind::Pratt;
+		}
+		else if (arg == "--parser=stack") {
+			options.parser = ParserKind::Stack;
+		}
+		else if (arg == "--fused") {
+			options.fused = true;
+		}
+		else if (arg == "--cache" && i + 1 < argc) {
+			options.cache = (size_t)std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg.compare(0, 8, "--cache=") == 0) {
+			options.cache = (size_t)std::strtoull(arg.c_str() + 8, nullptr, 10);
+		}
+		else if (arg == "--cache-file" && i + 1 < argc) {
+			options.cache_file = argv[++i];
+		}
+		else if (arg.compare(0, 13, "--cache-file=") == 0) {
+			options.cache_file = argv[i] + 13;
+		}
+		else if (arg == "--columns" && i + 1 < argc) {
+			options.columns = argv[++i];
+		}
+		else if (arg.compare(0, 10, "--columns=") == 0) {
+			options.columns = argv[i] + 10;
+		}
+		else if (arg == "--stats") {
+			options.stats = true;
+		}
+		else if (arg == "--trace" && i + 1 < argc) {
+			options.trace = argv[++i];
+		}
+		else if (arg.compare(0, 8, "--trace=") == 0) {
+			options.trace = argv[i] + 8;
+		}
+		else if (arg == "--bench") {
+			options.bench = true;
+		}
+		else if (arg.compare(0, 8, "--bench=") == 0) {
+			options.bench = true;
+			options.bench_seed = std::strtoull(arg.c_str() + 8, nullptr, 10);
+		}
+		else if (arg == "--serve" && i + 1 < argc) {
+			options.serve = argv[++i];
+		}
+		else if (arg.compare(0, 8, "--serve=") == 0) {
+			options.serve = argv[i] + 8;
+		}
+		else if (arg == "--connect" && i + 1 < argc) {
+			options.connect = argv[++i];
+		}
+		else if (arg.compare(0, 10, "--connect=") == 0) {
+			options.connect = argv[i] + 10;
+		}
+		else if (arg == "--format=text") {
+			options.format = OutputFormat::Text;
+		}
+		else if (arg == "--format=binary") {
+			options.format = OutputFormat::Binary;
+		}
+		else if (arg.compare(0, 2, "--") == 0) {
+			std::cerr << "unknown option " << arg << '\n';
+			return 1;
+		}
+		else {
+			options.path = argv[i];
+		}
+	}
+	if (options.jobs == 0) {
+		options.jobs = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if (options.bench) {
+		run_bench(options);
 		return 0;
 	}
+	if (options.stats || options.serve != nullptr) {
+		std::signal(SIGUSR1, request_stats);
+	}
 
-	int result = 0;
-	size_t i = 0;
-
-	// 1. ʮơ˽ơ
-	if (i < str.size() && str[i] == '0') {
-		i++;
+	InputReader in(options.path);
+	if (!in.ok()) {
+		std::cerr << "cannot open " << options.path << '\n';
+		return 1;
+	}
+	if (options.connect != nullptr) {
+		return run_client(options.connect, in) ? 0 : 1;
+	}
 
-		// ʮ
-		if (i < str.size() && str[i] == 'x') {
-			i++;
-			while (i < str.size()) {
-				char c = std::tolower(str[i]);
-				if (std::isdigit(c)) {
-					result = result * 16 + char2digit(c);
-				}
-				else if (c >= 'a' && c <= 'f') {
-					result = result * 16 + (c - 'a' + 10);
-				}
-				else {
-					break;
-				}
-				i++;
-			}
+	std::unique_ptr<DiskCache> disk_cache;
+	std::unique_ptr<ColumnTable> columns;
+	if (options.columns != nullptr) {
+		columns.reset(new ColumnTable());
+		std::string error;
+		if (!columns->load(options.columns, error)) {
+			std::cerr << error << '\n';
+			return 1;
 		}
+	}
 
-		// 
-		else if (i < str.size() && str[i] == 'b') {
-			i++;
-			while (i < str.size() && std::isdigit(str[i]) && str[i] == '0' || str[i] == '1') {
-				result = result * 2 + char2digit(str[i]);
-				i++;
-			}
+	if (options.fused || columns != nullptr) {
+		// With --fused the lines are parsed while they are lexed, there is no token list to look up before parsing.
+		// With --columns a line has many results.
+		options.cache = 0;
+		options.cache_file = nullptr;
+	}
+	if (options.cache_file != nullptr) {
+		disk_cache.reset(new DiskCache(options.cache_file));
+		if (!disk_cache->ok()) {
+			std::cerr << "cannot use " << options.cache_file << " as a cache file\n";
+			return 1;
 		}
+	}
 
-		// ˽
-		else {
-			while (i < str.size() && std::isdigit(str[i]) && str[i] >= '0' && str[i] <= '7') {
-				result = result * 8 + char2digit(str[i]);
-				i++;
-			}
+	// The server and its clients speak text whatever the --format
+	OutputWriter writer;
+	if (options.format == OutputFormat::Binary && options.serve == nullptr) {
+		writer.write(std::string_view(BINARY_MAGIC, sizeof(BINARY_MAGIC)));
+	}
+	if (options.serve != nullptr) {
+		Server server(options, disk_cache.get());
+		if (!server.run(options.serve)) {
+			return 1;
 		}
 	}
-
-	// 2. ʮ
+	else if (options.jobs > 1) {
+		run_parallel(in, options, writer, disk_cache.get(), columns.get());
+	}
 	else {
-		while (i < str.size() && std::isdigit(str[i])) {
-			result = result * 10 + char2digit(str[i]);
-			i++;
+		LineEvaluator ev(options, &writer, disk_cache.get(), columns.get());
+		ev.run(in);
+		ev.flush();
+		writer.flush();
+		if (options.eval == EvalMode::Dag) {
+			report_sharing(ev.dag);
 		}
-	}
-
-	return result;
-}
-
-
-int main() 
-{
-	std::string stdin_str;
-	std::getline(std::cin, stdin_str);
-	stdin_str += "\n";
-
-	DFA dfa;
-	Token tk;
-	std::vector<Token> tokens;
-
-	for (size_t i = 0; i < stdin_str.size(); i++) {
-		if (dfa.next(stdin_str[i], tk)) {
-			std::cout << toString(tk.type) << "  " << tk.value << '\n';
-			tokens.push_back(tk);
+		if (options.cache > 0 || disk_cache != nullptr) {
+			report_cache(ev.cache_stats);
+		}
+		if (options.stats) {
+			print_stats(ev.stats, stderr);
 		}
 	}
 
-	//  hw2
-	Parser parser(tokens);
-	auto root = parser.get_abstract_syntax_tree();
-	std::cout << root->value;
+#ifdef TRACE
+	if (!Tracer::instance().write(options.trace)) {
+		std::cerr << "cannot write " << options.trace << '\n';
+		return 1;
+	}
+#endif
 
 	return  0;
-}
\ No newline at end of file
+}